@@ -23,5 +23,13 @@
 #define E_DELETE_FILE -18
 #define E_SEEK_FILE -19
 #define E_FREE_BLOCK -20
+#define E_DEFRAG -21
+#define E_CLONE_FILE -22
+#define E_MAP_FILE -23
+#define E_TRACE -24
+#define E_WRITEBACK -25
+#define E_SYNC -26
+#define E_DISCARD -27
+#define E_DEDUP -28
 
 #endif //INC_453PROJECT4_TINYFS_ERRNO_H
\ No newline at end of file
@@ -1,6 +1,16 @@
+#define _GNU_SOURCE /* fallocate and madvise for discardBlocks */
+#define _FILE_OFFSET_BITS 64 /* images larger than 2 GB on 32-bit hosts */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include "TinyFS_errno.h"
 
 #define NUM_TEST_DISKS 2
@@ -9,8 +19,224 @@
 #define NUM_TEST_BLOCKS 10
 #define TEST_BLOCKS {25,39,8,9,15,21,25,33,35,42}
 
+#define RAM_DISK_PREFIX "ram:" /* disk names starting with this live in memory */
+#define MAX_RAM_DISKS 4
+#define RAM_DISK_NAME_LEN 32
+
+#define MAX_DISKS 16 /* open disks, counting each member of a striped volume */
+#define STRIPE_SEPARATOR ',' /* "a.dsk,b.dsk" names a volume striped over both */
+#define MAX_STRIPE_MEMBERS 8
+#define DEFAULT_STRIPE_UNIT 8 /* blocks */
+#ifndef IOV_MAX
+#define IOV_MAX 1024 /* pieces one preadv or pwritev may take */
+#endif
+
 int TOTAL_DISKS = 0;
-FILE* disksFPs[NUM_TEST_DISKS] = {0};
+FILE* disksFPs[MAX_DISKS] = {0};
+
+typedef struct StripedDisk StripedDisk;
+
+typedef struct MemberIO {
+   StripedDisk *stripe;
+   int index;        // which member of the volume this is
+   long long bNum;   // first member block of this request
+   long long count;  // member blocks, 0 if this member isn't touched
+   struct iovec *iov; // where the share's units sit in the request's blocks
+   int room;          // entries iov has room for
+   int result;
+   long long round;  // last request this member's worker took
+} MemberIO;
+
+struct StripedDisk {
+   int members;
+   int member[MAX_STRIPE_MEMBERS]; // disk numbers of the member disks
+   int unit;                       // blocks per stripe unit
+
+   // One worker thread per member, started when the volume is opened,
+   // moves each member's share of requests that span several members
+   pthread_t worker[MAX_STRIPE_MEMBERS];
+   int workers;                    // workers started
+   MemberIO io[MAX_STRIPE_MEMBERS];
+   pthread_mutex_t request;        // one request at a time per volume
+   pthread_mutex_t lock;           // guards the fields below
+   pthread_cond_t work;            // a new round of requests is ready
+   pthread_cond_t done;            // busy reached 0
+   long long round;
+   int busy;                       // workers still on this round
+   int stop;
+   char *blocks;                   // the request's volume blocks
+   long long volumeStart, volumeCount;
+   int write;
+};
+
+StripedDisk* disksStripe[MAX_DISKS] = {0};
+
+int openDisk(char *filename, long long nBytes);
+int closeDisk(int disk);
+static int startStripeWorkers(StripedDisk *stripe);
+static void stopStripeWorkers(StripedDisk *stripe);
+
+typedef struct RamDisk {
+   char name[RAM_DISK_NAME_LEN];
+   char *arena; // block storage, NULL if this entry is unused
+   long long size; // bytes in arena, always a multiple of BLOCKSIZE
+} RamDisk;
+
+// RAM disks outlive closeDisk so a file system can be unmounted and
+// mounted again; they are only replaced by opening the name with nBytes > 0
+// and only given up by destroyRamDisk
+RamDisk ramDisks[MAX_RAM_DISKS];
+RamDisk* disksRAM[MAX_DISKS] = {0};
+
+/* Returns the RAM disk named by filename (after RAM_DISK_PREFIX), or NULL
+if there is none. With create set, an unused entry is claimed instead. */
+static RamDisk* findRamDisk(const char *filename, int create) {
+   const char *name = filename + strlen(RAM_DISK_PREFIX);
+   RamDisk *unused = NULL;
+   for(int i = 0; i < MAX_RAM_DISKS; i++) {
+      if(ramDisks[i].arena == NULL) {
+         if(unused == NULL) unused = &ramDisks[i];
+      }
+      else if(strncmp(ramDisks[i].name, name, RAM_DISK_NAME_LEN) == 0) {
+         return &ramDisks[i];
+      }
+   }
+   if(!create || unused == NULL) return NULL;
+   strncpy(unused->name, name, RAM_DISK_NAME_LEN - 1);
+   unused->name[RAM_DISK_NAME_LEN - 1] = '\0';
+   return unused;
+}
+
+static int isRamDiskName(const char *filename) {
+   return strncmp(filename, RAM_DISK_PREFIX, strlen(RAM_DISK_PREFIX)) == 0;
+}
+
+/* Returns the host's page size, the unit RAM disks hand memory back in. */
+static long pageSize(void) {
+   long size = sysconf(_SC_PAGESIZE);
+   return size > 0 ? size : 4096;
+}
+
+/* Allocates a zeroed, page aligned arena of nBytes for a RAM disk. */
+static int allocRamDisk(RamDisk *ram, long long nBytes) {
+   void *arena = NULL;
+   if(posix_memalign(&arena, pageSize(), nBytes) != 0) {
+      return E_OPEN_DISK;
+   }
+   memset(arena, 0, nBytes);
+   free(ram->arena);
+   ram->arena = arena;
+   ram->size = nBytes;
+   return E_SUCCESS;
+}
+
+/* Places an opened disk in a free slot and returns its disk number. */
+static int claimDiskSlot(FILE *diskFile, RamDisk *ram, StripedDisk *stripe) {
+   // Reuse the slot of a closed disk if there is one
+   for(int disk = 0; disk < TOTAL_DISKS; disk++) {
+      if(disksFPs[disk] == NULL && disksRAM[disk] == NULL && disksStripe[disk] == NULL) {
+         disksFPs[disk] = diskFile;
+         disksRAM[disk] = ram;
+         disksStripe[disk] = stripe;
+         return disk;
+      }
+   }
+   if(TOTAL_DISKS >= MAX_DISKS) {
+      if(diskFile != NULL) fclose(diskFile);
+      return E_OPEN_DISK; // No free disk slot
+   }
+
+   // Store file pointer and increase disk count
+   disksFPs[TOTAL_DISKS] = diskFile;
+   disksRAM[TOTAL_DISKS] = ram;
+   disksStripe[TOTAL_DISKS] = stripe;
+   return TOTAL_DISKS++;
+}
+
+static int diskIsOpen(int disk) {
+   return disk >= 0 && disk < TOTAL_DISKS &&
+          (disksFPs[disk] != NULL || disksRAM[disk] != NULL || disksStripe[disk] != NULL);
+}
+
+/* Opens every member named in a STRIPE_SEPARATOR separated list as one
+striped volume. New volumes split nBytes evenly across the members. */
+static int openStripedDisk(char *filename, long long nBytes) {
+   StripedDisk *stripe = calloc(1, sizeof(StripedDisk));
+   char *names = malloc(strlen(filename) + 1);
+   if(stripe == NULL || names == NULL) {
+      free(stripe);
+      free(names);
+      return E_OPEN_DISK;
+   }
+   strcpy(names, filename);
+   stripe->unit = DEFAULT_STRIPE_UNIT;
+
+   // Empty names are skipped, so "a.dsk," is a volume of one member
+   int members = 0;
+   for(char *c = names; *c != '\0'; c++) {
+      if(*c != STRIPE_SEPARATOR && (c == names || c[-1] == STRIPE_SEPARATOR)) members++;
+   }
+   long long memberBlocks = (nBytes / BLOCKSIZE + members - 1) / members;
+
+   int result = E_SUCCESS;
+   char *name = names;
+   while(name != NULL && result == E_SUCCESS) {
+      char *next = strchr(name, STRIPE_SEPARATOR);
+      if(next != NULL) *next++ = '\0';
+      if(*name == '\0') {
+         name = next;
+         continue;
+      }
+      if(stripe->members == MAX_STRIPE_MEMBERS) {
+         result = E_OPEN_DISK;
+         break;
+      }
+      int member = openDisk(name, nBytes == 0 ? 0 : memberBlocks * BLOCKSIZE);
+      if(member < 0) {
+         result = member;
+         break;
+      }
+      stripe->member[stripe->members++] = member;
+      name = next;
+   }
+   free(names);
+   if(stripe->members == 0) {
+      result = E_OPEN_DISK;
+   }
+
+   if(result != E_SUCCESS) {
+      for(int i = 0; i < stripe->members; i++) {
+         closeDisk(stripe->member[i]);
+      }
+      free(stripe);
+      return result;
+   }
+   result = startStripeWorkers(stripe);
+   if(result == E_SUCCESS) {
+      result = claimDiskSlot(NULL, NULL, stripe);
+   }
+   if(result < 0) {
+      stopStripeWorkers(stripe);
+      for(int i = 0; i < stripe->members; i++) {
+         closeDisk(stripe->member[i]);
+      }
+      free(stripe);
+   }
+   return result;
+}
+
+/* Sets how many consecutive blocks go to one member before moving to the
+next. Has no effect on disks that aren't striped. The unit is not stored
+by libDisk; the file system keeps it and sets it again on every open. */
+int setStripeUnit(int disk, int blocks) {
+   if(!diskIsOpen(disk) || blocks <= 0) {
+      return E_OPEN_DISK;
+   }
+   if(disksStripe[disk] != NULL) {
+      disksStripe[disk]->unit = blocks;
+   }
+   return E_SUCCESS;
+}
 
 /* This functions opens a regular UNIX file and designates the first nBytes of it as space for the emulated disk. 
 If nBytes is not exactly a multiple of BLOCKSIZE then the disk size will be the closest multiple
@@ -18,9 +244,28 @@ of BLOCKSIZE that is lower than nByte (but greater than 0)
 If nBytes > BLOCKSIZE and there is already a file by the given filename, that file’s content may be overwritten. 
 If nBytes is 0, an existing disk is opened, and the content must not be overwritten in this function. 
 There is no requirement to maintain integrity of any file content beyond nBytes. 
+A filename starting with RAM_DISK_PREFIX names a disk kept in memory
+instead of a UNIX file; see snapshotDisk and restoreDisk for saving it.
+A filename with several names separated by STRIPE_SEPARATOR opens them
+together as one volume with blocks striped across the members.
 The return value is negative on failure or a disk number on success. */
 
-int openDisk(char *filename, int nBytes) {
+int openDisk(char *filename, long long nBytes) {
+   if(strchr(filename, STRIPE_SEPARATOR) != NULL) {
+      return openStripedDisk(filename, nBytes);
+   }
+   if(isRamDiskName(filename)) {
+      RamDisk *ram = findRamDisk(filename, nBytes != 0);
+      if(ram == NULL) return E_OPEN_DISK;
+      if(nBytes != 0) {
+         if(nBytes < BLOCKSIZE) { return E_READ_BLOCK; }
+         if(allocRamDisk(ram, nBytes - nBytes % BLOCKSIZE) != E_SUCCESS) {
+            return E_OPEN_DISK;
+         }
+      }
+      return claimDiskSlot(NULL, ram, NULL);
+   }
+
    FILE *diskFile = NULL;
    if(nBytes == 0) {
       diskFile = fopen(filename, "rb+");
@@ -36,71 +281,501 @@ int openDisk(char *filename, int nBytes) {
          nBytes -= blockOffset;
       }
 
-      // Initalize the blocks with '0' value
-      char* buffer = (char*)calloc(nBytes, 1);
-      fwrite(buffer, 1, nBytes, diskFile);
-      free(buffer);
+      // Initalize the blocks with '0' value; extending the file reads back
+      // as zeros without writing (or buffering) gigabytes of them
+      if(ftruncate(fileno(diskFile), (off_t)nBytes) != 0) {
+         fclose(diskFile);
+         return E_OPEN_DISK;
+      }
    }
 
-   // Store file pointer and increase disk count
-   disksFPs[TOTAL_DISKS] = diskFile;
-   return TOTAL_DISKS++;
+   return claimDiskSlot(diskFile, NULL, NULL);
 }
 int closeDisk(int disk) {
    // Check if the disk number is valid
-   if(disk < 0 || disk >= TOTAL_DISKS) {
+   if(!diskIsOpen(disk)) {
       return -1;
    }
 
-   // Check if a disk file is open for the given disk number
-   FILE *diskFile = disksFPs[disk];
-   if(diskFile == NULL) {
-      return -1;
+   // Close the disk file; RAM disks keep their contents
+   if(disksFPs[disk] != NULL) {
+      fclose(disksFPs[disk]);
+   }
+   StripedDisk *stripe = disksStripe[disk];
+   if(stripe != NULL) {
+      stopStripeWorkers(stripe);
+      for(int i = 0; i < stripe->members; i++) {
+         closeDisk(stripe->member[i]);
+      }
+      free(stripe);
    }
 
-   // Close the disk file
-   fclose(diskFile);
-
-   // Remove the disk file pointer from the array
+   // Remove the disk from the array
    disksFPs[disk] = NULL;
+   disksRAM[disk] = NULL;
+   disksStripe[disk] = NULL;
 
    return 0; // Return success
 }
 
-int readBlock(int disk, int bNum, void* block) {
+/* Writes the RAM disk ramName to the UNIX file filename as an ordinary
+disk image, which openDisk and tfs_mount can open directly. */
+int snapshotDisk(char *ramName, char *filename) {
+   if(!isRamDiskName(ramName)) return E_OPEN_DISK;
+   RamDisk *ram = findRamDisk(ramName, 0);
+   if(ram == NULL) return E_OPEN_DISK;
+
+   FILE *imageFile = fopen(filename, "wb");
+   if(imageFile == NULL) return E_OPEN_DISK;
+   size_t writeSize = fwrite(ram->arena, 1, (size_t)ram->size, imageFile);
+   if(fclose(imageFile) != 0 || writeSize < (size_t)ram->size) {
+      return E_WRITE_BLOCK;
+   }
+   return E_SUCCESS;
+}
+
+/* Loads the disk image in the UNIX file filename into the RAM disk
+ramName, replacing its contents. Disks already open on ramName see the
+new contents. */
+int restoreDisk(char *filename, char *ramName) {
+   if(!isRamDiskName(ramName)) return E_OPEN_DISK;
+   FILE *imageFile = fopen(filename, "rb");
+   if(imageFile == NULL) return E_OPEN_DISK;
+
+   long long nBytes = -1;
+   if(fseeko(imageFile, 0, SEEK_END) == 0) {
+      nBytes = ftello(imageFile);
+   }
+   nBytes -= nBytes % BLOCKSIZE;
+   RamDisk *ram = findRamDisk(ramName, 1);
+   if(nBytes < BLOCKSIZE || ram == NULL || allocRamDisk(ram, nBytes) != E_SUCCESS) {
+      fclose(imageFile);
+      return E_OPEN_DISK;
+   }
+
+   rewind(imageFile);
+   size_t readSize = fread(ram->arena, 1, (size_t)nBytes, imageFile);
+   fclose(imageFile);
+   if(readSize < (size_t)nBytes) {
+      return E_READ_BLOCK;
+   }
+   return E_SUCCESS;
+}
+
+/* Frees the RAM disk ramName and its entry, so the name can be used for
+another disk. Fails while the disk is open. */
+int destroyRamDisk(char *ramName) {
+   if(!isRamDiskName(ramName)) return E_OPEN_DISK;
+   RamDisk *ram = findRamDisk(ramName, 0);
+   if(ram == NULL) return E_OPEN_DISK;
+   for(int disk = 0; disk < MAX_DISKS; disk++) {
+      if(disksRAM[disk] == ram) return E_OPEN_DISK;
+   }
+   free(ram->arena);
+   ram->arena = NULL;
+   ram->size = 0;
+   return E_SUCCESS;
+}
+
+/* Checks that count blocks starting at bNum lie inside a RAM disk. */
+static int ramRange(RamDisk *ram, long long bNum, long long count) {
+   return bNum >= 0 && count >= 0 && bNum + count <= ram->size / BLOCKSIZE;
+}
+
+static int transferBlocks(int disk, long long bNum, long long count, void* blocks, int write);
+
+/* Reads or writes count blocks of a file or RAM disk starting at bNum,
+to or from the iovcnt pieces of iov. The pieces are used up as they go. */
+static int vectorTransfer(int disk, long long bNum, long long count, struct iovec *iov, int iovcnt, int write) {
+   int ioError = write ? E_WRITE_BLOCK : E_READ_BLOCK;
+   RamDisk* ram = disksRAM[disk];
+   if(ram != NULL) {
+      if(!ramRange(ram, bNum, count)) {
+         return ioError; // Past the end of the disk
+      }
+      char *diskBlock = ram->arena + bNum * BLOCKSIZE;
+      for(int i = 0; i < iovcnt; i++) {
+         if(write) {
+            memcpy(diskBlock, iov[i].iov_base, iov[i].iov_len);
+         } else {
+            memcpy(iov[i].iov_base, diskBlock, iov[i].iov_len);
+         }
+         diskBlock += iov[i].iov_len;
+      }
+      return E_SUCCESS;
+   }
+
+   int fd = fileno(disksFPs[disk]);
+   off_t offset = (off_t)bNum * BLOCKSIZE;
+   while(iovcnt > 0) {
+      int pieces = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+      ssize_t done = write ? pwritev(fd, iov, pieces, offset) : preadv(fd, iov, pieces, offset);
+      if(done <= 0) {
+         return ioError; // Read or write error, or past the end of the file
+      }
+      offset += done;
+      while(done > 0) {
+         if((size_t)done >= iov->iov_len) {
+            done -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+         } else {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= (size_t)done;
+            done = 0;
+         }
+      }
+   }
+   return E_SUCCESS;
+}
+
+/* Moves one member's share of the volume's current request in a single
+member request, straight to or from the request's blocks: the share's
+stripe units are contiguous on the member but apart in the request. */
+static void memberTransfer(MemberIO *io) {
+   StripedDisk *stripe = io->stripe;
+   int unit = stripe->unit;
+   long long end = stripe->volumeStart + stripe->volumeCount;
+   int pieces = 0;
+   for(long long b = stripe->volumeStart; b < end; ) {
+      long long stripeNum = b / unit;
+      long long unitEnd = (stripeNum + 1) * unit < end ? (stripeNum + 1) * unit : end;
+      if(stripeNum % stripe->members == io->index) {
+         if(pieces == io->room) {
+            int room = io->room > 0 ? io->room * 2 : 64;
+            struct iovec *iov = realloc(io->iov, room * sizeof(struct iovec));
+            if(iov == NULL) {
+               io->result = E_OPEN_DISK;
+               return;
+            }
+            io->iov = iov;
+            io->room = room;
+         }
+         io->iov[pieces].iov_base = stripe->blocks + (b - stripe->volumeStart) * BLOCKSIZE;
+         io->iov[pieces++].iov_len = (size_t)(unitEnd - b) * BLOCKSIZE;
+      }
+      b = unitEnd;
+   }
+   io->result = vectorTransfer(stripe->member[io->index], io->bNum, io->count,
+                               io->iov, pieces, stripe->write);
+}
+
+static void* memberWorker(void *arg) {
+   MemberIO *io = arg;
+   StripedDisk *stripe = io->stripe;
+   pthread_mutex_lock(&stripe->lock);
+   for(;;) {
+      while(!stripe->stop && io->round == stripe->round) {
+         pthread_cond_wait(&stripe->work, &stripe->lock);
+      }
+      if(stripe->stop) break;
+      io->round = stripe->round;
+      pthread_mutex_unlock(&stripe->lock);
+      if(io->count > 0) {
+         memberTransfer(io);
+      }
+      pthread_mutex_lock(&stripe->lock);
+      if(--stripe->busy == 0) {
+         pthread_cond_signal(&stripe->done);
+      }
+   }
+   pthread_mutex_unlock(&stripe->lock);
+   return NULL;
+}
+
+/* Starts a worker for every member of a volume of more than one. */
+static int startStripeWorkers(StripedDisk *stripe) {
+   pthread_mutex_init(&stripe->request, NULL);
+   pthread_mutex_init(&stripe->lock, NULL);
+   pthread_cond_init(&stripe->work, NULL);
+   pthread_cond_init(&stripe->done, NULL);
+   for(int m = 0; m < stripe->members; m++) {
+      stripe->io[m].stripe = stripe;
+      stripe->io[m].index = m;
+   }
+   if(stripe->members == 1) {
+      return E_SUCCESS; // Requests never span members
+   }
+   for(int m = 0; m < stripe->members; m++) {
+      if(pthread_create(&stripe->worker[m], NULL, memberWorker, &stripe->io[m]) != 0) {
+         return E_OPEN_DISK;
+      }
+      stripe->workers++;
+   }
+   return E_SUCCESS;
+}
+
+static void stopStripeWorkers(StripedDisk *stripe) {
+   pthread_mutex_lock(&stripe->lock);
+   stripe->stop = 1;
+   pthread_cond_broadcast(&stripe->work);
+   pthread_mutex_unlock(&stripe->lock);
+   for(int m = 0; m < stripe->workers; m++) {
+      pthread_join(stripe->worker[m], NULL);
+   }
+   for(int m = 0; m < stripe->members; m++) {
+      free(stripe->io[m].iov);
+   }
+   pthread_mutex_destroy(&stripe->request);
+   pthread_mutex_destroy(&stripe->lock);
+   pthread_cond_destroy(&stripe->work);
+   pthread_cond_destroy(&stripe->done);
+}
+
+/* Splits a run of volume blocks into one contiguous request per member.
+Requests that span several members are handed to the members' workers,
+which move their shares at the same time. */
+static int stripedTransfer(StripedDisk *stripe, long long bNum, long long count, char *blocks, int write) {
+   int unit = stripe->unit;
+   int members = stripe->members;
+   pthread_mutex_lock(&stripe->request);
+   stripe->blocks = blocks;
+   stripe->volumeStart = bNum;
+   stripe->volumeCount = count;
+   stripe->write = write;
+
+   // A member's share of a run is contiguous on that member, from its
+   // first unit in the run to its last
+   int used = 0;
+   MemberIO *only = NULL;
+   for(int m = 0; m < members; m++) {
+      stripe->io[m].count = 0;
+   }
+   for(long long b = bNum; b < bNum + count; b = (b / unit + 1) * unit) {
+      long long stripeNum = b / unit;
+      MemberIO *io = &stripe->io[stripeNum % members];
+      long long memberBlock = stripeNum / members * unit + b % unit;
+      long long last = (b / unit + 1) * unit < bNum + count ? (b / unit + 1) * unit - 1 : bNum + count - 1;
+      if(io->count == 0) {
+         io->bNum = memberBlock;
+         used++;
+         only = io;
+      }
+      io->count = memberBlock + (last - b) - io->bNum + 1;
+   }
+
+   // A run within one member is in the same order there, so it goes
+   // straight from the caller's blocks
+   int result = E_SUCCESS;
+   if(used == 1) {
+      result = transferBlocks(stripe->member[only->index], only->bNum, only->count, blocks, write);
+   } else if(used > 1) {
+      pthread_mutex_lock(&stripe->lock);
+      stripe->busy = members;
+      stripe->round++;
+      pthread_cond_broadcast(&stripe->work);
+      while(stripe->busy > 0) {
+         pthread_cond_wait(&stripe->done, &stripe->lock);
+      }
+      pthread_mutex_unlock(&stripe->lock);
+      for(int m = 0; m < members; m++) {
+         if(stripe->io[m].count > 0 && stripe->io[m].result != E_SUCCESS) {
+            result = stripe->io[m].result;
+         }
+      }
+   }
+   pthread_mutex_unlock(&stripe->request);
+   return result;
+}
+
+/* Reads or writes count consecutive blocks starting at bNum. */
+static int transferBlocks(int disk, long long bNum, long long count, void* blocks, int write) {
+   int ioError = write ? E_WRITE_BLOCK : E_READ_BLOCK;
+
    // Check if the disk number is valid and disk is open
-   if(disk < 0 || disk >= TOTAL_DISKS || disksFPs[disk] == NULL) {
+   if(!diskIsOpen(disk)) {
       return E_OPEN_DISK; // Disk not available
    }
+   if(bNum < 0 || count < 0) {
+      return ioError;
+   }
 
-   FILE* readDisk = disksFPs[disk];
-   if (fseek(readDisk, bNum*BLOCKSIZE, SEEK_SET) != 0) {
-      return E_READ_BLOCK; // Seek error
+   if(disksStripe[disk] != NULL) {
+      return stripedTransfer(disksStripe[disk], bNum, count, blocks, write);
    }
-   int checkSize = fread(block, sizeof(char), BLOCKSIZE, readDisk);
-   if(checkSize < BLOCKSIZE) {
-      return E_READ_BLOCK; // Read error
+
+   RamDisk* ram = disksRAM[disk];
+   if(ram != NULL) {
+      if(!ramRange(ram, bNum, count)) {
+         return ioError; // Past the end of the disk
+      }
+      char *diskBlock = ram->arena + bNum * BLOCKSIZE;
+      if(write) {
+         memcpy(diskBlock, blocks, (size_t)count * BLOCKSIZE);
+      } else {
+         memcpy(blocks, diskBlock, (size_t)count * BLOCKSIZE);
+      }
+      return E_SUCCESS;
+   }
+
+   // pread and pwrite take the offset with each request instead of
+   // sharing the stream's position, so a background writer and a reader
+   // can use the same disk at once. The byte offset is worked out in
+   // off_t, which is 64 bits wide here.
+   int fd = fileno(disksFPs[disk]);
+   off_t offset = (off_t)bNum * BLOCKSIZE;
+   size_t remaining = (size_t)count * BLOCKSIZE;
+   char *cursor = blocks;
+   while(remaining > 0) {
+      ssize_t done = write ? pwrite(fd, cursor, remaining, offset)
+                           : pread(fd, cursor, remaining, offset);
+      if(done <= 0) {
+         return ioError; // Read or write error, or past the end of the file
+      }
+      cursor += done;
+      offset += done;
+      remaining -= (size_t)done;
    }
    return E_SUCCESS; // Success
 }
 
-int writeBlock(int disk, int bNum, void* block) {
+/* Reads count consecutive blocks starting at bNum with a single seek, so
+sequential readers can fetch a whole run in one request. */
+int readBlocks(int disk, long long bNum, long long count, void* blocks) {
+   return transferBlocks(disk, bNum, count, blocks, 0);
+}
+
+/* Writes count consecutive blocks starting at bNum in one request. */
+int writeBlocks(int disk, long long bNum, long long count, void* blocks) {
+   return transferBlocks(disk, bNum, count, blocks, 1);
+}
+
+int readBlock(int disk, long long bNum, void* block) {
+   return readBlocks(disk, bNum, 1, block);
+}
+
+int writeBlock(int disk, long long bNum, void* block) {
+   return writeBlocks(disk, bNum, 1, block);
+}
+
+/* Waits until the host reports everything written to the disk stored. RAM disks have nothing to do. */
+int syncDisk(int disk) {
    // Check if the disk number is valid and disk is open
-   if(disk < 0 || disk >= TOTAL_DISKS || disksFPs[disk] == NULL) {
+   if(!diskIsOpen(disk)) {
       return E_OPEN_DISK; // Disk not available
    }
 
-   FILE* writeDisk = disksFPs[disk];
-   if (fseek(writeDisk, bNum*BLOCKSIZE, SEEK_SET) != 0) {
-      return E_WRITE_BLOCK; // Seek error
+   StripedDisk *stripe = disksStripe[disk];
+   if(stripe != NULL) {
+      int result = E_SUCCESS;
+      for(int i = 0; i < stripe->members; i++) {
+         int synced = syncDisk(stripe->member[i]);
+         if(synced != E_SUCCESS) result = synced;
+      }
+      return result;
+   }
+
+   FILE* diskFile = disksFPs[disk];
+   if(diskFile == NULL) {
+      return E_SUCCESS;
    }
-   size_t writeSize = fwrite(block, sizeof(char), BLOCKSIZE, writeDisk);
-   if(writeSize < BLOCKSIZE) {
-      return E_WRITE_BLOCK; // Write error
+   if(fdatasync(fileno(diskFile)) != 0) {
+      return E_SYNC;
    }
-   return E_SUCCESS; // Success
+   return E_SUCCESS;
 }
 
+/* Tells the host that count blocks starting at bNum hold nothing worth
+keeping, so they stop taking up space. Image files have the range punched
+out; RAM disks hand whole pages back. The blocks then read back as zeros. */
+int discardBlocks(int disk, long long bNum, long long count) {
+   // Check if the disk number is valid and disk is open
+   if(!diskIsOpen(disk)) {
+      return E_OPEN_DISK; // Disk not available
+   }
+   if(bNum < 0 || count < 0) {
+      return E_DISCARD;
+   }
+   if(count == 0) {
+      return E_SUCCESS;
+   }
+
+   // A member's share of a run is contiguous on that member
+   StripedDisk *stripe = disksStripe[disk];
+   if(stripe != NULL) {
+      long long first[MAX_STRIPE_MEMBERS], last[MAX_STRIPE_MEMBERS];
+      int result = E_SUCCESS;
+      for(int m = 0; m < stripe->members; m++) {
+         first[m] = -1;
+         last[m] = -1;
+      }
+      for(long long b = bNum; b < bNum + count; b++) {
+         long long stripeNum = b / stripe->unit;
+         int m = (int)(stripeNum % stripe->members);
+         long long memberBlock = stripeNum / stripe->members * stripe->unit + b % stripe->unit;
+         if(first[m] < 0) first[m] = memberBlock;
+         last[m] = memberBlock;
+      }
+      for(int m = 0; m < stripe->members; m++) {
+         if(first[m] < 0) continue;
+         int discarded = discardBlocks(stripe->member[m], first[m], last[m] - first[m] + 1);
+         if(discarded != E_SUCCESS) result = discarded;
+      }
+      return result;
+   }
+
+   RamDisk* ram = disksRAM[disk];
+   if(ram != NULL) {
+      if(!ramRange(ram, bNum, count)) {
+         return E_DISCARD; // Past the end of the disk
+      }
+      // Whole pages come back zero filled; the ragged ends are cleared by hand
+      long long page = pageSize();
+      long long startByte = bNum * BLOCKSIZE;
+      long long endByte = (bNum + count) * BLOCKSIZE;
+      long long pageStart = (startByte + page - 1) / page * page;
+      long long pageEnd = endByte / page * page;
+      if(pageEnd > pageStart &&
+         madvise(ram->arena + pageStart, (size_t)(pageEnd - pageStart), MADV_DONTNEED) == 0) {
+         memset(ram->arena + startByte, 0, (size_t)(pageStart - startByte));
+         memset(ram->arena + pageEnd, 0, (size_t)(endByte - pageEnd));
+      } else {
+         memset(ram->arena + startByte, 0, (size_t)(endByte - startByte));
+      }
+      return E_SUCCESS;
+   }
+
+   FILE* diskFile = disksFPs[disk];
+#ifdef FALLOC_FL_PUNCH_HOLE
+   if(fallocate(fileno(diskFile), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                (off_t)bNum * BLOCKSIZE, (off_t)count * BLOCKSIZE) == 0) {
+      return E_SUCCESS;
+   }
+#endif
+   return E_DISCARD; // The host can't punch holes in this file
+}
+
+/* Returns the number of whole blocks in the emulated disk, or a negative
+error code if the disk is not open. */
+long long diskBlocks(int disk) {
+   // Check if the disk number is valid and disk is open
+   if(!diskIsOpen(disk)) {
+      return E_OPEN_DISK; // Disk not available
+   }
+
+   if(disksRAM[disk] != NULL) {
+      return disksRAM[disk]->size / BLOCKSIZE;
+   }
+
+   // A striped volume ends where its smallest member runs out of units
+   StripedDisk *stripe = disksStripe[disk];
+   if(stripe != NULL) {
+      long long smallest = -1;
+      for(int i = 0; i < stripe->members; i++) {
+         long long blocks = diskBlocks(stripe->member[i]);
+         if(blocks < 0) return blocks;
+         if(smallest < 0 || blocks < smallest) smallest = blocks;
+      }
+      return smallest / stripe->unit * stripe->unit * stripe->members;
+   }
+
+   // fstat leaves the file position alone for readers on other threads
+   struct stat st;
+   if(fstat(fileno(disksFPs[disk]), &st) != 0) {
+      return E_READ_BLOCK;
+   }
+   return st.st_size / BLOCKSIZE;
+}
 
 int main()
 {
@@ -13,18 +13,31 @@
 #define NUM_TEST_BLOCKS 10
 #define TEST_BLOCKS {25,39,8,9,15,21,25,33,35,42}
 
+#define RAM_DISK_PREFIX "ram:" /* disk names starting with this live in memory */
+#define STRIPE_SEPARATOR ',' /* "a.dsk,b.dsk" names a volume striped over both */
+#define DEFAULT_STRIPE_UNIT 8 /* blocks */
+
 #define TOTAL_DISKS 3
 extern FILE* disksFPs[TOTAL_DISKS];
-int openDisk(char *filename, int nBytes);
+int openDisk(char *filename, long long nBytes);
 int closeDisk(int disk);
-int readBlock(int disk, int bNum, void *block);
-int writeBlock(int disk, int bNum, void *block);
-
-int find_file(const char* name);
-int create_file(const char* name);
-int* allocate_blocks(int num_blocks);
-void remove_blocks(int* blocks_start);
-void freeBlock(int current_block);
+int readBlock(int disk, long long bNum, void *block);
+int writeBlock(int disk, long long bNum, void *block);
+int readBlocks(int disk, long long bNum, long long count, void *blocks);
+int writeBlocks(int disk, long long bNum, long long count, void *blocks);
+long long diskBlocks(int disk);
+int snapshotDisk(char *ramName, char *filename);
+int restoreDisk(char *filename, char *ramName);
+int destroyRamDisk(char *ramName);
+int setStripeUnit(int disk, int blocks);
+int syncDisk(int disk);
+int discardBlocks(int disk, long long bNum, long long count);
+
+long long find_file(const char* name);
+long long create_file(const char* name);
+long long* allocate_blocks(long long num_blocks);
+void remove_blocks(long long* blocks_start);
+void freeBlock(long long current_block);
 
 #endif //INC_453PROJECT4_LIBDISK_H
 
@@ -1,6 +1,10 @@
+#define _XOPEN_SOURCE 700
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <limits.h>
 #include "TinyFS_errno.h"
 #include "libDisk.h"
 #include "tinyFS.h"
@@ -12,14 +16,877 @@ int mounted_disk = -1;
 // Global variable for next file descriptor to allocate
 fileDescriptor next_fd = 0;
 
+typedef struct MapRun {
+   blockNumber block; // first block of the file in the run
+   blockNumber start; // disk block holding it, -1 for a hole
+   blockNumber count;
+} MapRun;
+
+// Where each block of a file is on disk, as runs in file order
+typedef struct FileMap {
+   MapRun *runs;
+   blockNumber count;
+   blockNumber room;
+} FileMap;
+
 typedef struct FileEntry {
    char *filename;
-   int file_pointer;
-   int inode;
+   byteCount file_pointer;
+   blockNumber inode;
+   blockNumber last_block; // block index of the last tfs_readByte, -1 if none
+   int ra_window;          // current read-ahead window in blocks, 0 when off
+   blockNumber ra_next;    // first block index not yet prefetched
+   FileMap map;            // where the file's blocks are on disk
+   int map_generation;     // inode_generation when map was read, -1 if never
 } FileEntry;
 
 FileEntry resource_table[MAX_OPEN_FILES];
 
+typedef struct PendingWrite {
+   blockNumber inode; // file the contents belong to
+   char *data;        // contents from tfs_writeFile not yet on disk, NULL if unused
+   byteCount size;
+   long long since;   // when the contents were buffered
+   long long seq;     // tells a later tfs_writeFile from these contents
+   int flushing;      // the flusher is writing these contents out
+} PendingWrite;
+
+// Buffered file contents, kept by file rather than by descriptor so a
+// file closed with write-back on is left for the flusher to write
+PendingWrite pending_writes[MAX_OPEN_FILES];
+int pending_count = 0; // slots in use, which tfs_writeFile fills lowest first
+long long pending_seq = 0;
+
+// Total bytes held in pending write buffers across all files
+byteCount pending_bytes = 0;
+
+static void drop_pending(PendingWrite *pending);
+static PendingWrite *pending_entry(blockNumber inode_num);
+static void flusher_drain(void);
+static int flush_all(void);
+static int do_unmount(void);
+static int release_chain(blockNumber first_block);
+static void discard_forget(blockNumber start, blockNumber count);
+static void discard_pending(void);
+static int write_free_links(blockNumber first, blockNumber count, blockNumber last_next);
+static void free_run(blockNumber start, blockNumber count);
+static int add_block_refs(blockNumber bNum, blockNumber count, int delta);
+static int block_refs(blockNumber bNum);
+static blockNumber refcount_table(int create);
+static blockNumber free_space_take(blockNumber count);
+static int free_space_contains(blockNumber bNum);
+static void free_space_reset(void);
+static void name_index_reset(void);
+static void name_index_remove(const char *name);
+static void defrag_reset(void);
+static int free_space_load(void);
+static int dedup_load(void);
+static unsigned long long dedup_hash(const char *data);
+static void block_payload(const char *buffer, byteCount size, blockNumber block_num, char *data);
+static blockNumber dedup_share(const char *data, unsigned long long hash);
+static void dedup_insert(unsigned long long hash, blockNumber block);
+static void dedup_count(blockNumber blocks, blockNumber shared);
+static void dedup_writeback(void);
+static void dedup_reset(void);
+
+// Largest read-ahead window, 0 disables read-ahead entirely
+int read_ahead_max = READ_AHEAD_MAX;
+
+// Stripe unit tfs_mkfs gives new striped volumes, in blocks
+int stripe_unit = DEFAULT_STRIPE_UNIT;
+
+// Whether flushing turns all-zero blocks into holes
+int sparse_writes = 1;
+
+// Bumped on every inode write so descriptors know to redo block lookups
+int inode_generation = 0;
+
+// Format revision of the mounted disk and the file data each of its
+// data blocks holds
+int disk_format = FORMAT_REVISION;
+int extent_data_size = EXTENT_DATA_SIZE;
+
+// Serialises tfs_* calls with the background flusher; recursive because
+// some calls make others
+pthread_mutex_t fs_lock;
+pthread_once_t fs_lock_once = PTHREAD_ONCE_INIT;
+
+static void init_fs_lock(void) {
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&fs_lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+}
+
+// Write-back settings; while writeback_enabled is 0 the cache is
+// write-through and no flusher runs
+int writeback_enabled = 0;
+int writeback_age_ms = WRITEBACK_AGE_MS;
+int writeback_dirty_ratio = WRITEBACK_DIRTY_RATIO;
+int flusher_generation = 0; // a flusher exits once this moves past its own
+int writeback_error = E_SUCCESS; // first failed write-back since last sync
+
+// When freed blocks are handed back to the host (tfs_discard)
+int discard_mode = DISCARD_BATCHED;
+
+// Whether file flushes look for identical blocks to share (tfs_dedup)
+int dedup_enabled = 0;
+
+static long long clock_ns(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Block contents shared by the cache and tfs_mapFile views. A buffer is
+// only modified in place while the cache holds the sole reference; once a
+// view pins it, the cache moves on to a new buffer instead.
+typedef struct CacheBuffer {
+   int refs;
+   char data[BLOCKSIZE];
+} CacheBuffer;
+
+typedef struct CacheEntry {
+   blockNumber block; // disk block held in this slot, -1 if empty
+   CacheBuffer *buf;
+   int dirty; // newer than the disk; only while write-back is enabled
+   long long dirty_since;
+} CacheEntry;
+
+// Direct-mapped cache of blocks on the mounted disk, write-through unless
+// tfs_writeback turned on write-back
+CacheEntry block_cache[CACHE_BLOCKS];
+
+/* Revision 1 disks keep superblocks, inodes and free blocks in the 32-bit
+layouts. The cache holds blocks as they are on disk; these convert them on
+the way to and from the rest of the file system. Extents are used in place
+through extent_next and extent_data instead, since their data would not
+fit the other layout. */
+static void decode_block(const void *raw, void *block) {
+   memcpy(block, raw, BLOCKSIZE);
+   if(disk_format != FORMAT_REVISION_32) {
+      return;
+   }
+   switch(((const unsigned char *)raw)[0]) {
+   case SUPERBLOCK_TYPE: {
+      const superblock_v1_t *old = raw;
+      superblock_t *sb = block;
+      memset(sb, 0, BLOCKSIZE);
+      sb->block_type = old->block_type;
+      sb->magic_number = old->magic_number;
+      sb->format_revision = FORMAT_REVISION_32;
+      sb->root_inode = old->root_inode;
+      sb->free_block_list = old->free_block_list;
+      sb->refcount_table = old->refcount_table;
+      sb->stripe_unit = old->stripe_unit;
+      break;
+   }
+   case INODE_TYPE: {
+      const inode_v1_t *old = raw;
+      inode_t *inode = block;
+      memset(inode, 0, BLOCKSIZE);
+      inode->block_type = old->block_type;
+      inode->magic_number = old->magic_number;
+      memcpy(inode->file_name, old->file_name, sizeof(inode->file_name));
+      inode->file_size = old->file_size;
+      inode->file_extent = old->file_extent;
+      memcpy(inode->hole_map, old->hole_map, HOLE_MAP_BYTES);
+      break;
+   }
+   case FREE_BLOCK_TYPE: {
+      const free_block_v1_t *old = raw;
+      free_block_t *free_block = block;
+      memset(free_block, 0, BLOCKSIZE);
+      free_block->block_type = old->block_type;
+      free_block->magic_number = old->magic_number;
+      free_block->next_free_block = old->next_free_block;
+      break;
+   }
+   }
+}
+
+static void encode_block(const void *block, void *raw) {
+   memcpy(raw, block, BLOCKSIZE);
+   if(disk_format != FORMAT_REVISION_32) {
+      return;
+   }
+   switch(((const unsigned char *)block)[0]) {
+   case SUPERBLOCK_TYPE: {
+      const superblock_t *sb = block;
+      superblock_v1_t *old = raw;
+      memset(old, 0, BLOCKSIZE);
+      old->block_type = sb->block_type;
+      old->magic_number = sb->magic_number;
+      old->root_inode = (int)sb->root_inode;
+      old->free_block_list = (int)sb->free_block_list;
+      old->refcount_table = (int)sb->refcount_table;
+      old->stripe_unit = sb->stripe_unit;
+      break;
+   }
+   case INODE_TYPE: {
+      const inode_t *inode = block;
+      inode_v1_t *old = raw;
+      memset(old, 0, BLOCKSIZE);
+      old->block_type = inode->block_type;
+      old->magic_number = inode->magic_number;
+      memcpy(old->file_name, inode->file_name, sizeof(old->file_name));
+      old->file_size = (int)inode->file_size;
+      old->file_extent = (int)inode->file_extent;
+      memcpy(old->hole_map, inode->hole_map, HOLE_MAP_BYTES);
+      break;
+   }
+   case FREE_BLOCK_TYPE: {
+      const free_block_t *free_block = block;
+      free_block_v1_t *old = raw;
+      memset(old, 0, BLOCKSIZE);
+      old->block_type = free_block->block_type;
+      old->magic_number = free_block->magic_number;
+      old->next_free_block = (int)free_block->next_free_block;
+      break;
+   }
+   }
+}
+
+static blockNumber extent_next(const void *extent) {
+   if(disk_format == FORMAT_REVISION_32) {
+      return ((const file_extent_v1_t *)extent)->next_block;
+   }
+   return ((const file_extent_t *)extent)->next_block;
+}
+
+static void set_extent_next(void *extent, blockNumber next) {
+   if(disk_format == FORMAT_REVISION_32) {
+      ((file_extent_v1_t *)extent)->next_block = (int)next;
+   } else {
+      ((file_extent_t *)extent)->next_block = next;
+   }
+}
+
+static char *extent_data(void *extent) {
+   if(disk_format == FORMAT_REVISION_32) {
+      return ((file_extent_v1_t *)extent)->data;
+   }
+   if(disk_format == FORMAT_REVISION_LINKED) {
+      return ((file_extent_t *)extent)->data;
+   }
+   return ((data_block_t *)extent)->data;
+}
+
+/* Returns the largest file the mounted disk's format can describe. */
+static byteCount max_file_size(void) {
+   return disk_format == FORMAT_REVISION_32 ? INT_MAX : LLONG_MAX;
+}
+
+typedef struct InflightRun {
+   blockNumber start;
+   blockNumber count;
+   char *data; // the blocks as they are being written
+} InflightRun;
+
+// Writes the flusher took a copy of under fs_lock and is issuing without
+// it. Until they land, reads of those blocks take the copy instead of
+// what is on disk, and other writes to them wait, so the disk never ends
+// up with the older contents.
+pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inflight_done = PTHREAD_COND_INITIALIZER;
+InflightRun *inflight_runs = NULL;
+int inflight_count = 0;
+int inflight_result = E_SUCCESS; // how the last batch went
+
+static int inflight_overlaps(blockNumber bNum, blockNumber count) {
+   for(int i = 0; i < inflight_count; i++) {
+      if(inflight_runs[i].start < bNum + count && bNum < inflight_runs[i].start + inflight_runs[i].count) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/* Waits until no write in flight touches count blocks starting at bNum. */
+static void inflight_wait(blockNumber bNum, blockNumber count) {
+   pthread_mutex_lock(&inflight_lock);
+   while(inflight_overlaps(bNum, count)) {
+      pthread_cond_wait(&inflight_done, &inflight_lock);
+   }
+   pthread_mutex_unlock(&inflight_lock);
+}
+
+/* Reads count blocks of the mounted disk starting at bNum, as they will
+be once the writes in flight land. */
+static int disk_read(blockNumber bNum, blockNumber count, void *blocks) {
+   // Holding inflight_lock across the read means a run still listed
+   // afterwards had not finished before the read started
+   pthread_mutex_lock(&inflight_lock);
+   int result = readBlocks(mounted_disk, bNum, count, blocks);
+   for(int i = 0; result == E_SUCCESS && i < inflight_count; i++) {
+      InflightRun *run = &inflight_runs[i];
+      blockNumber first = run->start > bNum ? run->start : bNum;
+      blockNumber end = run->start + run->count < bNum + count ? run->start + run->count : bNum + count;
+      if(first < end) {
+         memcpy((char *)blocks + (first - bNum) * BLOCKSIZE,
+                run->data + (first - run->start) * BLOCKSIZE, (end - first) * BLOCKSIZE);
+      }
+   }
+   pthread_mutex_unlock(&inflight_lock);
+   return result;
+}
+
+/* Writes count blocks of the mounted disk starting at bNum, after any
+write in flight to the same blocks. */
+static int disk_write(blockNumber bNum, blockNumber count, void *blocks) {
+   inflight_wait(bNum, count);
+   return writeBlocks(mounted_disk, bNum, count, blocks);
+}
+
+/* Writes a dirty slot back to the disk. */
+static void cache_clean(CacheEntry *entry) {
+   if(!entry->dirty) {
+      return;
+   }
+   int result = disk_write(entry->block, 1, entry->buf->data);
+   if(result != E_SUCCESS && writeback_error == E_SUCCESS) {
+      writeback_error = result;
+   }
+   entry->dirty = 0;
+}
+
+static void cache_unpin(CacheBuffer *buf) {
+   if(buf != NULL && --buf->refs == 0) {
+      free(buf);
+   }
+}
+
+static void cache_invalidate(void) {
+   for(int i = 0; i < CACHE_BLOCKS; i++) {
+      block_cache[i].block = -1;
+      block_cache[i].dirty = 0;
+      cache_unpin(block_cache[i].buf);
+      block_cache[i].buf = NULL;
+   }
+}
+
+static void cache_insert(blockNumber bNum, const void *block) {
+   CacheEntry *entry = &block_cache[bNum % CACHE_BLOCKS];
+   if(entry->block != bNum) {
+      cache_clean(entry); // Evicting another block
+   }
+   entry->dirty = 0;
+   if(entry->buf == NULL || entry->buf->refs > 1) {
+      cache_unpin(entry->buf);
+      entry->buf = malloc(sizeof(CacheBuffer));
+      if(entry->buf == NULL) {
+         entry->block = -1;
+         return;
+      }
+      entry->buf->refs = 1;
+   }
+   entry->block = bNum;
+   memcpy(entry->buf->data, block, BLOCKSIZE);
+}
+
+static int cache_contains(blockNumber bNum) {
+   return block_cache[bNum % CACHE_BLOCKS].block == bNum;
+}
+
+/* Drops cached copies of count blocks starting at first without writing
+them, for blocks whose old contents no longer matter. */
+static void cache_forget(blockNumber first, blockNumber count) {
+   for(int i = 0; i < CACHE_BLOCKS; i++) {
+      CacheEntry *entry = &block_cache[i];
+      if(entry->block >= first && entry->block < first + count) {
+         cache_unpin(entry->buf);
+         entry->buf = NULL;
+         entry->block = -1;
+         entry->dirty = 0;
+      }
+   }
+}
+
+/* Stands in a free list link for block bNum if it reads back as zeros,
+which only a discarded free block does. */
+static void decode_discarded(blockNumber bNum, void *block) {
+   if(disk_format == FORMAT_REVISION_32 || ((unsigned char *)block)[0] != 0) {
+      return;
+   }
+   free_block_t *free_block = block;
+   free_block->block_type = FREE_BLOCK_TYPE;
+   free_block->magic_number = MAGIC_NUMBER;
+   free_block->next_free_block = bNum + 1;
+}
+
+/* Reads block bNum of the mounted disk, from the cache if present. */
+static int cache_read_block(blockNumber bNum, void *block) {
+   CacheEntry *entry = &block_cache[bNum % CACHE_BLOCKS];
+   if(entry->block == bNum) {
+      decode_block(entry->buf->data, block);
+      decode_discarded(bNum, block);
+      return E_SUCCESS;
+   }
+   char raw[BLOCKSIZE];
+   int result = disk_read(bNum, 1, raw);
+   if(result == E_SUCCESS) {
+      cache_insert(bNum, raw);
+      decode_block(raw, block);
+      decode_discarded(bNum, block);
+   }
+   return result;
+}
+
+/* Caches raw, the encoded contents of block bNum, marked dirty for the
+flusher. Returns 0 if it could not be cached and still has to be written. */
+static int cache_mark_dirty(blockNumber bNum, const char *raw) {
+   CacheEntry *entry = &block_cache[bNum % CACHE_BLOCKS];
+   int was_dirty = entry->block == bNum && entry->dirty;
+   cache_insert(bNum, raw);
+   if(entry->block != bNum) {
+      return 0;
+   }
+   if(!was_dirty) {
+      entry->dirty_since = clock_ns();
+   }
+   entry->dirty = 1;
+   return 1;
+}
+
+/* Writes block bNum of the mounted disk and keeps the cache in step. With
+write-back on, the block is only marked dirty for the flusher. */
+static int cache_write_block(blockNumber bNum, void *block) {
+   if(((unsigned char *)block)[0] == INODE_TYPE) {
+      inode_generation++;
+   }
+   char raw[BLOCKSIZE];
+   encode_block(block, raw);
+   if(writeback_enabled && cache_mark_dirty(bNum, raw)) {
+      return E_SUCCESS;
+   }
+   int result = disk_write(bNum, 1, raw);
+   if(result == E_SUCCESS) {
+      cache_insert(bNum, raw);
+   }
+   return result;
+}
+
+/* Fills order with the slots of blocks dirtied at or before cutoff (0 for
+all of them), sorted by block number. Returns how many there are. */
+static int cache_dirty_slots(long long cutoff, int *order) {
+   int count = 0;
+   for(int i = 0; i < CACHE_BLOCKS; i++) {
+      CacheEntry *entry = &block_cache[i];
+      if(!entry->dirty || (cutoff != 0 && entry->dirty_since > cutoff)) {
+         continue;
+      }
+      // Insertion sort by block number
+      int j = count++;
+      while(j > 0 && block_cache[order[j - 1]].block > entry->block) {
+         order[j] = order[j - 1];
+         j--;
+      }
+      order[j] = i;
+   }
+   return count;
+}
+
+/* Writes every dirty block dirtied at or before cutoff (0 for all of
+them), merging neighbouring blocks into single requests. */
+static void cache_writeback(long long cutoff) {
+   int order[CACHE_BLOCKS];
+   int count = cache_dirty_slots(cutoff, order);
+   char run[CACHE_BLOCKS * BLOCKSIZE];
+   for(int i = 0; i < count; ) {
+      blockNumber first = block_cache[order[i]].block;
+      int n = 0;
+      while(i + n < count && block_cache[order[i + n]].block == first + n) {
+         memcpy(run + n * BLOCKSIZE, block_cache[order[i + n]].buf->data, BLOCKSIZE);
+         n++;
+      }
+      int result = disk_write(first, n, run);
+      if(result != E_SUCCESS && writeback_error == E_SUCCESS) {
+         writeback_error = result;
+      }
+      for(int k = 0; k < n; k++) {
+         block_cache[order[i + k]].dirty = 0;
+      }
+      i += n;
+   }
+}
+
+/* Writes count consecutive blocks starting at bNum in one request. With
+write-back on, a run short enough to sit in the cache without pushing
+out much else is only marked dirty for the flusher, like single blocks;
+longer runs, such as the links of a large freed file, are still written
+at once. */
+static int cache_write_blocks(blockNumber bNum, blockNumber count, char *blocks) {
+   if(writeback_enabled && count <= WRITEBACK_RUN_BLOCKS) {
+      int result = E_SUCCESS;
+      for(blockNumber i = 0; i < count; i++) {
+         if(!cache_mark_dirty(bNum + i, blocks + i * BLOCKSIZE)) {
+            int written = disk_write(bNum + i, 1, blocks + i * BLOCKSIZE);
+            if(written != E_SUCCESS) {
+               result = written;
+            }
+         }
+      }
+      return result;
+   }
+   int result = disk_write(bNum, count, blocks);
+   for(blockNumber i = 0; result == E_SUCCESS && i < count; i++) {
+      cache_insert(bNum + i, blocks + i * BLOCKSIZE);
+   }
+   return result;
+}
+
+/* Reads count consecutive blocks starting at bNum into the cache with a
+single disk request. Blocks already cached are left alone. */
+static int cache_prefetch(blockNumber bNum, int count) {
+   if(count <= 0) {
+      return E_SUCCESS;
+   }
+   char *blocks = malloc(count * BLOCKSIZE);
+   if(blocks == NULL) {
+      return E_READ_BLOCK;
+   }
+   int result = disk_read(bNum, count, blocks);
+   if(result == E_SUCCESS) {
+      for(int i = 0; i < count; i++) {
+         if(!cache_contains(bNum + i)) {
+            cache_insert(bNum + i, blocks + i * BLOCKSIZE);
+         }
+      }
+   }
+   free(blocks);
+   return result;
+}
+
+/* Returns the cache buffer holding bNum with an extra reference the
+caller must drop with cache_unpin, or NULL on error. */
+static CacheBuffer *cache_pin(blockNumber bNum) {
+   if(!cache_contains(bNum)) {
+      char block[BLOCKSIZE];
+      if(cache_read_block(bNum, block) != E_SUCCESS || !cache_contains(bNum)) {
+         return NULL;
+      }
+   }
+   CacheBuffer *buf = block_cache[bNum % CACHE_BLOCKS].buf;
+   buf->refs++;
+   return buf;
+}
+
+/* Sets the largest read-ahead window in blocks. 0 turns read-ahead off. */
+static int do_readAhead(int maxBlocks) {
+   if(maxBlocks < 0 || maxBlocks > CACHE_BLOCKS / 2) {
+      return E_READ_FILE;
+   }
+   read_ahead_max = maxBlocks;
+   return E_SUCCESS;
+}
+
+/* Sets the stripe unit, in blocks, for volumes made by later tfs_mkfs
+calls on several disks. The unit is kept in the superblock, so existing
+volumes keep theirs. */
+static int do_stripeUnit(int blocks) {
+   if(blocks <= 0) {
+      return E_MOUNT_FS;
+   }
+   stripe_unit = blocks;
+   return E_SUCCESS;
+}
+
+/* Sets whether all-zero blocks are stored as holes when files are
+flushed. Holes made earlier stay holes either way. */
+static int do_sparseWrites(int enabled) {
+   sparse_writes = enabled != 0;
+   return E_SUCCESS;
+}
+
+static int is_hole(const inode_t *inode, blockNumber block_num) {
+   return block_num < MAX_SPARSE_BLOCKS &&
+          (inode->hole_map[block_num / 8] >> (block_num % 8)) & 1;
+}
+
+static void set_hole(inode_t *inode, blockNumber block_num) {
+   inode->hole_map[block_num / 8] |= 1 << (block_num % 8);
+}
+
+static void file_map_free(FileMap *map) {
+   free(map->runs);
+   map->runs = NULL;
+   map->count = 0;
+   map->room = 0;
+}
+
+/* Returns the number of blocks of the file map covers, holes included. */
+static blockNumber file_map_blocks(const FileMap *map) {
+   if(map->count == 0) {
+      return 0;
+   }
+   return map->runs[map->count - 1].block + map->runs[map->count - 1].count;
+}
+
+/* Appends count blocks held on disk from block start on, or a hole for a
+start of -1, merging them into the last run if they carry on from it. */
+static int file_map_add(FileMap *map, blockNumber start, blockNumber count) {
+   if(count <= 0) {
+      return E_SUCCESS;
+   }
+   MapRun *last = map->count > 0 ? &map->runs[map->count - 1] : NULL;
+   if(last != NULL && (start < 0 ? last->start == start : last->start >= 0 && last->start + last->count == start)) {
+      last->count += count;
+      return E_SUCCESS;
+   }
+   blockNumber block = file_map_blocks(map);
+   if(map->count == map->room) {
+      blockNumber room = map->room > 0 ? map->room * 2 : 8;
+      MapRun *runs = realloc(map->runs, room * sizeof(MapRun));
+      if(runs == NULL) {
+         return E_FILE_TOO_BIG;
+      }
+      map->runs = runs;
+      map->room = room;
+   }
+   MapRun *run = &map->runs[map->count++];
+   run->block = block;
+   run->start = start;
+   run->count = count;
+   return E_SUCCESS;
+}
+
+/* Returns the index of the run holding block block_num of the file, or
+map->count past its end. */
+static blockNumber file_map_find(const FileMap *map, blockNumber block_num) {
+   blockNumber low = 0;
+   blockNumber high = map->count;
+   while(low < high) {
+      blockNumber mid = low + (high - low) / 2;
+      if(map->runs[mid].block + map->runs[mid].count <= block_num) {
+         low = mid + 1;
+      } else {
+         high = mid;
+      }
+   }
+   return low;
+}
+
+/* Returns the disk block holding block block_num of the file, or -1 for a
+hole. */
+static blockNumber physical_block(const FileMap *map, blockNumber block_num) {
+   blockNumber i = file_map_find(map, block_num);
+   if(i == map->count || map->runs[i].start < 0) {
+      return -1;
+   }
+   return map->runs[i].start + block_num - map->runs[i].block;
+}
+
+/* Reads the map of the file inode describes. Revision 3 inodes list their
+extents, continued in extent map blocks; on older revisions the blocks
+that are not holes form one contiguous run from file_extent on. */
+static int file_map_load(const inode_t *inode, FileMap *map) {
+   memset(map, 0, sizeof(*map));
+   int result = E_SUCCESS;
+   if(disk_format != FORMAT_REVISION) {
+      blockNumber num_blocks = (inode->file_size + extent_data_size - 1) / extent_data_size;
+      blockNumber next = inode->file_extent;
+      blockNumber i = 0;
+      for(; i < num_blocks && i < MAX_SPARSE_BLOCKS && result == E_SUCCESS; i++) {
+         result = file_map_add(map, is_hole(inode, i) ? -1 : next++, 1);
+      }
+      if(result == E_SUCCESS) {
+         result = file_map_add(map, next, num_blocks - i);
+      }
+   } else {
+      const inode_v3_t *v3 = (const inode_v3_t *)inode;
+      for(int i = 0; i < INODE_EXTENTS && v3->extents[i].count > 0 && result == E_SUCCESS; i++) {
+         result = file_map_add(map, v3->extents[i].start < 0 ? -1 : v3->extents[i].start, v3->extents[i].count);
+      }
+      blockNumber total_blocks = diskBlocks(mounted_disk);
+      blockNumber current = v3->extent_map;
+      for(blockNumber visited = 0; current != -1 && result == E_SUCCESS; visited++) {
+         extent_map_block_t block;
+         if(current <= 0 || current >= total_blocks || visited >= total_blocks ||
+            cache_read_block(current, &block) != E_SUCCESS ||
+            block.block_type != EXTENT_MAP_TYPE || block.magic_number != MAGIC_NUMBER) {
+            result = E_READ_BLOCK; // Broken, or a chain longer than the disk
+            break;
+         }
+         for(int i = 0; i < MAP_BLOCK_EXTENTS && block.extents[i].count > 0 && result == E_SUCCESS; i++) {
+            result = file_map_add(map, block.extents[i].start < 0 ? -1 : block.extents[i].start, block.extents[i].count);
+         }
+         current = block.next_block;
+      }
+   }
+   if(result != E_SUCCESS) {
+      file_map_free(map);
+   }
+   return result;
+}
+
+/* Records map in inode, which the caller then writes. On revision 3 the
+extents that don't fit in the inode go in newly allocated extent map
+blocks, written here; older revisions can only hold maps whose data
+blocks are one contiguous run, with holes in the first MAX_SPARSE_BLOCKS
+blocks. */
+static int file_map_store(inode_t *inode, const FileMap *map) {
+   if(disk_format != FORMAT_REVISION) {
+      memset(inode->hole_map, 0, sizeof(inode->hole_map));
+      inode->file_extent = -1;
+      blockNumber next = -1;
+      for(blockNumber i = 0; i < map->count; i++) {
+         const MapRun *run = &map->runs[i];
+         if(run->start < 0) {
+            if(run->block + run->count > MAX_SPARSE_BLOCKS) {
+               return E_FILE_TOO_BIG;
+            }
+            for(blockNumber b = run->block; b < run->block + run->count; b++) {
+               set_hole(inode, b);
+            }
+            continue;
+         }
+         if(next >= 0 && run->start != next) {
+            return E_FILE_TOO_BIG;
+         }
+         if(next < 0) {
+            inode->file_extent = run->start;
+         }
+         next = run->start + run->count;
+      }
+      return E_SUCCESS;
+   }
+
+   inode_v3_t *v3 = (inode_v3_t *)inode;
+   memset(v3->extents, 0, sizeof(v3->extents));
+   v3->extent_map = -1;
+   blockNumber i = 0;
+   for(; i < map->count && i < INODE_EXTENTS; i++) {
+      v3->extents[i].start = map->runs[i].start;
+      v3->extents[i].count = map->runs[i].count;
+   }
+   blockNumber num_blocks = (map->count - i + MAP_BLOCK_EXTENTS - 1) / MAP_BLOCK_EXTENTS;
+   if(num_blocks == 0) {
+      return E_SUCCESS;
+   }
+
+   // The map blocks link to each other, so they need not be contiguous,
+   // but one run is taken if there is one so they go out in one request
+   blockNumber *blocks = malloc(num_blocks * sizeof(blockNumber));
+   char *raw = malloc(num_blocks * BLOCKSIZE);
+   blockNumber first = free_space_take(num_blocks);
+   blockNumber taken = 0;
+   int result = blocks != NULL && raw != NULL ? E_SUCCESS : E_WRITE_BLOCK;
+   for(; result == E_SUCCESS && taken < num_blocks; taken++) {
+      blocks[taken] = first >= 0 ? first + taken : free_space_take(1);
+      if(blocks[taken] < 0) {
+         result = E_DISK_FULL;
+         break;
+      }
+   }
+   for(blockNumber k = 0; result == E_SUCCESS && k < num_blocks; k++) {
+      extent_map_block_t *block = (extent_map_block_t *)(raw + k * BLOCKSIZE);
+      memset(block, 0, BLOCKSIZE);
+      block->block_type = EXTENT_MAP_TYPE;
+      block->magic_number = MAGIC_NUMBER;
+      block->next_block = k + 1 < num_blocks ? blocks[k + 1] : -1;
+      for(int j = 0; j < MAP_BLOCK_EXTENTS && i < map->count; j++, i++) {
+         block->extents[j].start = map->runs[i].start;
+         block->extents[j].count = map->runs[i].count;
+      }
+      if(first < 0) {
+         result = cache_write_block(blocks[k], block);
+      }
+   }
+   for(blockNumber k = 0; first >= 0 && result == E_SUCCESS && k < num_blocks; k += WRITE_BATCH_BLOCKS) {
+      blockNumber count = num_blocks - k < WRITE_BATCH_BLOCKS ? num_blocks - k : WRITE_BATCH_BLOCKS;
+      result = cache_write_blocks(first + k, count, raw + k * BLOCKSIZE);
+   }
+   if(result == E_SUCCESS) {
+      v3->extent_map = blocks[0];
+   } else if(first >= 0) {
+      free_run(first, num_blocks);
+   } else {
+      for(blockNumber k = 0; k < taken; k++) {
+         free_run(blocks[k], 1);
+      }
+   }
+   free(blocks);
+   free(raw);
+   return result != E_SUCCESS && result != E_DISK_FULL ? E_WRITE_BLOCK : result;
+}
+
+/* Frees the extent map blocks of a revision 3 inode about to be dropped
+or rewritten. */
+static void file_map_release_blocks(const inode_t *inode) {
+   if(disk_format != FORMAT_REVISION) {
+      return;
+   }
+   blockNumber total_blocks = diskBlocks(mounted_disk);
+   blockNumber run_start = -1;
+   blockNumber run_count = 0;
+   blockNumber current = ((const inode_v3_t *)inode)->extent_map;
+   for(blockNumber visited = 0; current > 0 && current < total_blocks && visited < total_blocks; visited++) {
+      extent_map_block_t block;
+      if(cache_read_block(current, &block) != E_SUCCESS || block.block_type != EXTENT_MAP_TYPE) {
+         break;
+      }
+      if(run_count > 0 && current == run_start + run_count) {
+         run_count++;
+      } else {
+         if(run_count > 0) {
+            free_run(run_start, run_count);
+         }
+         run_start = current;
+         run_count = 1;
+      }
+      current = block.next_block;
+   }
+   if(run_count > 0) {
+      free_run(run_start, run_count);
+   }
+}
+
+/* Drops the file's reference to every data block in map. Blocks no other
+file shares go back to the free list a contiguous run at a time. */
+static void file_map_release(const FileMap *map) {
+   int shared = refcount_table(0) >= 0;
+   for(blockNumber i = 0; i < map->count; i++) {
+      const MapRun *run = &map->runs[i];
+      if(run->start < 0) {
+         continue;
+      }
+      if(!shared) {
+         free_run(run->start, run->count);
+         continue;
+      }
+      blockNumber run_start = run->start;
+      for(blockNumber b = run->start; b < run->start + run->count; b++) {
+         if(block_refs(b) > 0) {
+            free_run(run_start, b - run_start);
+            add_block_refs(b, 1, -1);
+            run_start = b + 1;
+         }
+      }
+      free_run(run_start, run->start + run->count - run_start);
+   }
+}
+
+/* Adds delta to the share count of every data block in map; if that fails
+for one run, the runs before it are put back. */
+static int file_map_add_refs(const FileMap *map, int delta) {
+   for(blockNumber i = 0; i < map->count; i++) {
+      if(map->runs[i].start < 0) {
+         continue;
+      }
+      int result = add_block_refs(map->runs[i].start, map->runs[i].count, delta);
+      if(result != E_SUCCESS) {
+         while(i-- > 0) {
+            if(map->runs[i].start >= 0) {
+               add_block_refs(map->runs[i].start, map->runs[i].count, -delta);
+            }
+         }
+         return result;
+      }
+   }
+   return E_SUCCESS;
+}
+
 
 /* Makes a blank TinyFS file system of size nBytes on the unix file
 specified by ‘filename’. This function should use the emulated disk
@@ -28,27 +895,60 @@ file to be a mountable disk. This includes initializing all data to 0x00,
 setting magic numbers, initializing and writing the superblock and
 inodes, etc. Must return a specified success/error code. */
 
-int tfs_mkfs(char *filename, int nBytes) {
-   // Open the Unix file with our block device emulator
+static int do_mkfs(char *filename, byteCount nBytes) {
+   // Open the Unix file with our block device emulator; a list of
+   // STRIPE_SEPARATOR separated files makes a striped volume
    int diskId = openDisk(filename, nBytes);
    if(diskId < 0) {
       return diskId; // Propagate the error
    }
+   setStripeUnit(diskId, stripe_unit);
 
    // Initialize and write the superblock
    struct superblock sb;
+   memset(&sb, 0, sizeof(sb));
    sb.block_type = 1;
    sb.magic_number = 0x44;
+   sb.format_revision = FORMAT_REVISION;
 
-   // Root inode and free block list initialized to -1 as they don't exist yet
+   // Root inode doesn't exist yet; every other block starts out free
    sb.root_inode = -1;
    sb.free_block_list = -1;
 
+   // The reference count table is created by the first tfs_cloneFile
+   sb.refcount_table = -1;
+   sb.stripe_unit = stripe_unit;
+
+   // So is the dedup index, by the first write with tfs_dedup on
+   sb.dedup_index = -1;
+
+   // Blocks 1..n-1 make up the free list in ascending order. openDisk
+   // hands back a disk of zeros, and a zero block already reads as a free
+   // block linked to the one after it, so only the last block needs
+   // writing, to end the list
+   blockNumber total_blocks = diskBlocks(diskId);
+   if(total_blocks > 1) {
+      free_block_t free_block;
+      memset(&free_block, 0, sizeof(free_block));
+      free_block.block_type = FREE_BLOCK_TYPE;
+      free_block.magic_number = MAGIC_NUMBER;
+      free_block.next_free_block = -1;
+      if(writeBlock(diskId, total_blocks - 1, &free_block) != E_SUCCESS) {
+         closeDisk(diskId);
+         return E_WRITE_BLOCK;
+      }
+      sb.free_block_list = 1;
+   }
+
    // Write the superblock to the first block of the disk
    if(writeBlock(diskId, 0, &sb) != E_SUCCESS) {
+      closeDisk(diskId);
       return E_WRITE_BLOCK; // Error writing block
    }
 
+   // tfs_mount opens the disk again, so release this handle
+   closeDisk(diskId);
+
    // Success
    return E_SUCCESS;
 }
@@ -60,7 +960,7 @@ system. As part of the mount operation, tfs_mount should verify the file
 system is the correct type. In tinyFS, only one file system may be
 mounted at a time. Use tfs_unmount to cleanly unmount the currently
 mounted file system. Must return a specified success/error code. */
-int tfs_mount(char *diskname) {
+static int do_mount(char *diskname) {
    // The disk drive must be already created, so 0 bytes for size
    int diskId = openDisk(diskname, 0);
 
@@ -70,31 +970,87 @@ int tfs_mount(char *diskname) {
    }
 
    // Now read the first block and check if magic number is correct
-   superblock_t sb;
-   if (readBlock(diskId, 0, &sb) != E_SUCCESS) {
+   unsigned char raw[BLOCKSIZE];
+   if (readBlock(diskId, 0, raw) != E_SUCCESS) {
+      closeDisk(diskId);
       return E_READ_BLOCK;
    }
 
-   if (sb.magic_number != MAGIC_NUMBER) {
+   // Revision 1 superblocks have zero in the revision byte
+   int format = raw[offsetof(superblock_t, format_revision)];
+   if (format == 0) {
+      format = FORMAT_REVISION_32;
+   }
+   if (raw[offsetof(superblock_t, magic_number)] != MAGIC_NUMBER || format > FORMAT_REVISION) {
+      closeDisk(diskId);
       return E_WRONG_FS; // Wrong filesystem type
    }
 
-   // Everything seems OK, "mount" the disk
+   // Everything seems OK, "mount" the disk. A disk mounted before is
+   // unmounted first, closing it; the new disk is mounted even if writing
+   // back what the old one still held failed
+   if (mounted_disk >= 0) {
+      do_unmount();
+   }
+   dedup_reset();
+   free_space_reset();
+   name_index_reset();
+   defrag_reset();
+   cache_invalidate();
    mounted_disk = diskId;
+   disk_format = format;
+   extent_data_size = format == FORMAT_REVISION_32 ? EXTENT_DATA_SIZE_V1
+                    : format == FORMAT_REVISION_LINKED ? EXTENT_DATA_SIZE_V2 : EXTENT_DATA_SIZE;
+
+   // Block 0 is on the first member whatever the stripe unit, so striped
+   // volumes learn their unit from the superblock
+   superblock_t sb;
+   decode_block(raw, &sb);
+   if (sb.stripe_unit > 0) {
+      setStripeUnit(diskId, sb.stripe_unit);
+   }
    return E_SUCCESS;
 }
 
-int tfs_unmount(void) {
+static int do_unmount(void) {
    // Check if there's a mounted disk
    if (mounted_disk < 0) {
       return E_NO_MOUNTED_DISK;
    }
 
-   // Possible clean-up operations removed for brevity
+   // Write out any file contents and dirty blocks still held in memory,
+   // and hand back freed blocks still queued for discard
+   flusher_drain();
+   int result = flush_all();
 
-   // "Unmount" the disk
+   // Contents that could not be written are dropped with every descriptor,
+   // since their inode numbers mean nothing on the next disk mounted
+   for (int i = 0; i < MAX_OPEN_FILES; i++) {
+      drop_pending(&pending_writes[i]);
+   }
+   for (int i = 0; i < next_fd; i++) {
+      resource_table[i].filename = NULL;
+      file_map_free(&resource_table[i].map);
+      resource_table[i].map_generation = -1;
+   }
+   next_fd = 0;
+   discard_pending();
+   dedup_writeback();
+   cache_writeback(0);
+   if (result == E_SUCCESS) {
+      result = writeback_error;
+   }
+   writeback_error = E_SUCCESS;
+
+   // "Unmount" the disk, closing it so buffered blocks reach the file
+   dedup_reset();
+   free_space_reset();
+   name_index_reset();
+   defrag_reset();
+   cache_invalidate();
+   closeDisk(mounted_disk);
    mounted_disk = -1;
-   return E_SUCCESS;
+   return result;
 }
 
 
@@ -103,9 +1059,9 @@ mounted file system. Creates a dynamic resource table entry for the file,
 and returns a file descriptor (integer) that can be used to reference
 this entry while the filesystem is mounted. */
 
-fileDescriptor tfs_openFile(char *name) {
+static fileDescriptor do_openFile(char *name) {
    // Check if the file already exists
-   int inode = find_file(name);
+   blockNumber inode = find_file(name);
    if (inode < 0) {
       // File doesn't exist, create it
       inode = create_file(name);
@@ -122,19 +1078,44 @@ fileDescriptor tfs_openFile(char *name) {
    // Add entry to resource table
    resource_table[next_fd].filename = name; // Assume the name is statically allocated
    resource_table[next_fd].inode = inode;
+   resource_table[next_fd].file_pointer = 0;
+   resource_table[next_fd].last_block = -1;
+   resource_table[next_fd].ra_window = 0;
+   resource_table[next_fd].ra_next = 0;
+   file_map_free(&resource_table[next_fd].map);
+   resource_table[next_fd].map_generation = -1;
 
    // Return the file descriptor
    return next_fd++;
 }
 
-int tfs_closeFile(fileDescriptor FD) {
+/* Returns whether FD names a file open now: not closed, and not deleted
+through this or another descriptor. Buffered contents are found by
+inode, and a deleted file's inode block goes to the next file created,
+so a stale descriptor must not reach them. */
+static int fd_open(fileDescriptor FD) {
+   return FD >= 0 && FD < next_fd && resource_table[FD].filename != NULL;
+}
+
+static int do_closeFile(fileDescriptor FD) {
    // Check for valid file descriptor
-   if (FD < 0 || FD >= next_fd) {
+   if (!fd_open(FD)) {
       return E_CLOSE_FILE; // Invalid file descriptor
    }
 
-   // De-allocate system resources
-   // (Depends on what resources are associated with open files in the filesystem)
+   // Write out buffered contents and release the buffer. With write-back
+   // on they are left for the flusher instead, like any other dirty data.
+   int result = E_SUCCESS;
+   if (!writeback_enabled) {
+      result = tfs_flush(FD);
+      PendingWrite *pending = pending_entry(resource_table[FD].inode);
+      if (pending != NULL) {
+         drop_pending(pending);
+      }
+   }
+   file_map_free(&resource_table[FD].map);
+   resource_table[FD].map_generation = -1;
+   resource_table[FD].filename = NULL;
 
    // Remove entry from resource table by simply marking it as available for reuse
    // (Assume closed file descriptors can be reused)
@@ -144,146 +1125,562 @@ int tfs_closeFile(fileDescriptor FD) {
       // A gap will be formed in the array, handle it according to your design choice (could use an explicit "is available" flag for each entry, or a linked list to track available entries, etc.)
    }
 
-   return E_SUCCESS;
+   return result;
 }
 
 
-/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire
-file’s content, to the file system. Previous content (if any) will be
-completely lost. Sets the file pointer to 0 (the start of file) when
-done. Returns success/error codes. */
-
-int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
-   // Check for a valid file descriptor
-   if (FD < 0 || FD >= next_fd) {
-      return E_WRITE_FILE; // Invalid file descriptor
+/* Releases a pending write buffer without writing it. */
+static void drop_pending(PendingWrite *pending) {
+   if (pending->data != NULL) {
+      pending_bytes -= pending->size;
+      pending_count--;
+      free(pending->data);
    }
+   pending->data = NULL;
+   pending->size = 0;
+   pending->flushing = 0;
+}
 
-   // Get the inode of the file
-   int inode_num = resource_table[FD].inode;
-   inode_t inode;
-   if (readBlock(mounted_disk, inode_num, &inode) != E_SUCCESS) {
-      return E_READ_BLOCK; // Error reading block
+/* Returns the unwritten contents buffered for inode_num, if any. */
+static PendingWrite *pending_entry(blockNumber inode_num) {
+   for (int i = 0, seen = 0; seen < pending_count; i++) {
+      if (pending_writes[i].data == NULL) {
+         continue;
+      }
+      if (pending_writes[i].inode == inode_num) {
+         return &pending_writes[i];
+      }
+      seen++;
    }
+   return NULL;
+}
 
-   // Calculate required number of blocks for the file content
-   int num_blocks = (size + BLOCKSIZE - 1) / BLOCKSIZE;
+typedef struct FlushJob {
+   PendingWrite *pending; // contents being written
+   long long seq;         // their seq, to tell if they were replaced since
+   FileMap map;           // where each block of the contents goes
+   blockNumber fresh_start; // run newly allocated for the blocks this flush
+   blockNumber fresh_count; // writes; the others are holes or shared
+   unsigned long long *hashes; // of each data block, with dedup on
+   blockNumber next_block; // file block flush_build looks at next
+   blockNumber built;      // data blocks flush_build has made so far
+   char *blocks;           // all the data blocks, for a flush by the flusher
+} FlushJob;
+
+// File flushes whose data blocks are in the flusher's batch in flight
+FlushJob flush_jobs[MAX_OPEN_FILES];
+int flush_job_count = 0;
+
+// Start of a run in a flush's map until flush_prepare has allocated it
+#define FRESH_RUN -2
+
+static int flush_fresh(const FlushJob *job, const MapRun *run) {
+   return run->start >= 0 && job->fresh_start >= 0 && run->start >= job->fresh_start &&
+          run->start < job->fresh_start + job->fresh_count;
+}
 
-   // Allocate new blocks for the file content
-   int* new_blocks = allocate_blocks(num_blocks);
-   if (new_blocks == NULL) {
-      return E_DISK_FULL; // Cannot allocate enough blocks
+/* Gives back what flush_prepare took for a flush that is not going
+ahead: the references to shared blocks and the newly allocated run. */
+static void flush_abandon(FlushJob *job) {
+   for (blockNumber i = 0; i < job->map.count; i++) {
+      MapRun *run = &job->map.runs[i];
+      if (run->start >= 0 && !flush_fresh(job, run)) {
+         add_block_refs(run->start, run->count, -1);
+      }
    }
+   if (job->fresh_count > 0 && job->fresh_start >= 0) {
+      free_run(job->fresh_start, job->fresh_count);
+   }
+   file_map_free(&job->map);
+   free(job->hashes);
+   job->hashes = NULL;
+}
 
-   // Remove the old blocks of the file
-   remove_blocks(&inode.file_extent);
-
-   // Set the updated file size and first block of the file extent in inode
-   inode.file_size = size;
-   inode.file_extent = new_blocks[0];
+/* Starts writing out pending contents: works out which blocks are holes,
+which dedup can share with blocks already on disk and which need
+writing, and allocates those as one contiguous run. Nothing on disk
+points at them until flush_commit writes the inode. */
+static int flush_prepare(PendingWrite *pending, FlushJob *job) {
+   memset(job, 0, sizeof(*job));
+   job->pending = pending;
+   job->seq = pending->seq;
+   job->fresh_start = -1;
 
-   // Write the updated inode back to the disk
-   if (writeBlock(mounted_disk, inode_num, &inode) != E_SUCCESS) {
-      return E_WRITE_BLOCK; // Error writing block
+   // Calculate required number of blocks for the file content
+   byteCount size = pending->size;
+   char *buffer = pending->data;
+   blockNumber num_blocks = (size + extent_data_size - 1) / extent_data_size;
+
+   // With dedup on, every data block is looked up by its hash, which is
+   // kept for the index
+   int dedup = dedup_enabled && disk_format == FORMAT_REVISION && num_blocks > 0 &&
+               dedup_load() == E_SUCCESS && free_space_load() == E_SUCCESS;
+   if (dedup) {
+      job->hashes = malloc(num_blocks * sizeof(unsigned long long));
+      dedup = job->hashes != NULL;
    }
 
-   // Write the file content to the allocated blocks
-   for (int i = 0; i < num_blocks; i++) {
-      file_extent_t extent;
-
-      // If it's not the last block, link it to the next block
-      if (i < num_blocks - 1) {
-         extent.next_block = new_blocks[i + 1];
-      } else {
-         extent.next_block = -1; // This is the last block
+   // Blocks of nothing but zeros become holes with no disk block
+   int result = E_SUCCESS;
+   blockNumber data_count = 0;
+   char data[BLOCKSIZE];
+   for (blockNumber i = 0; i < num_blocks && result == E_SUCCESS; i++) {
+      byteCount offset = i * extent_data_size;
+      byteCount length = size - offset > extent_data_size ? extent_data_size : size - offset;
+      int zero = sparse_writes && (disk_format == FORMAT_REVISION || i < MAX_SPARSE_BLOCKS);
+      for (byteCount j = 0; j < length && zero; j++) {
+         zero = buffer[offset + j] == 0;
       }
-
-      // Copy the data to the block
-      int bytes_to_copy = size > BLOCKSIZE ? BLOCKSIZE : size;
-      memcpy(extent.data, buffer, bytes_to_copy);
-      buffer += bytes_to_copy;
-      size -= bytes_to_copy;
-
-      // Write the block to the disk
-      if (writeBlock(mounted_disk, new_blocks[i], &extent) != E_SUCCESS) {
-         return E_WRITE_BLOCK; // Error writing block
+      if (zero) {
+         result = file_map_add(&job->map, -1, 1);
+         continue;
+      }
+      blockNumber shared = -1;
+      if (dedup) {
+         block_payload(buffer, size, i, data);
+         job->hashes[data_count] = dedup_hash(data);
+         shared = dedup_share(data, job->hashes[data_count]);
       }
+      data_count++;
+      result = file_map_add(&job->map, shared >= 0 ? shared : FRESH_RUN, 1);
    }
 
+   // Shared blocks take their references a run at a time, so the counts
+   // cost a table block write per run rather than per block. A run whose
+   // counts are full is written out again instead.
+   blockNumber shared_count = 0;
+   for (blockNumber i = 0; i < job->map.count; i++) {
+      MapRun *run = &job->map.runs[i];
+      if (run->start >= 0 && (result != E_SUCCESS ||
+                              add_block_refs(run->start, run->count, 1) != E_SUCCESS)) {
+         run->start = FRESH_RUN;
+      }
+      if (run->start == FRESH_RUN) {
+         job->fresh_count += run->count;
+      } else if (run->start >= 0) {
+         shared_count += run->count;
+      }
+   }
+
+   // Allocate new blocks for the rest, in file order. Whatever the cache
+   // held for them belonged to the free list and is stale now.
+   if (result == E_SUCCESS && job->fresh_count > 0) {
+      job->fresh_start = free_space_take(job->fresh_count);
+      if (job->fresh_start < 0) {
+         result = E_DISK_FULL; // Cannot allocate enough blocks
+      } else {
+         cache_forget(job->fresh_start, job->fresh_count);
+      }
+   }
+   for (blockNumber i = 0, next = job->fresh_start; result == E_SUCCESS && i < job->map.count; i++) {
+      if (job->map.runs[i].start == FRESH_RUN) {
+         job->map.runs[i].start = next;
+         next += job->map.runs[i].count;
+      }
+   }
+   if (result != E_SUCCESS) {
+      flush_abandon(job);
+      return result;
+   }
+
+   if (dedup) {
+      dedup_count(data_count, shared_count);
+   }
+   return E_SUCCESS;
+}
+
+/* Builds the next count blocks a flush writes into run, in file order.
+Revisions that link data blocks have each link to the one after it. */
+static void flush_build(FlushJob *job, blockNumber count, char *run) {
+   const char *buffer = job->pending->data;
+   byteCount size = job->pending->size;
+   for (blockNumber k = 0; k < count; ) {
+      // Holes and shared blocks are skipped a run at a time
+      MapRun *map_run = &job->map.runs[file_map_find(&job->map, job->next_block)];
+      if (!flush_fresh(job, map_run)) {
+         job->next_block = map_run->block + map_run->count;
+         continue;
+      }
+      file_extent_t extent;
+      memset(&extent, 0, sizeof(extent));
+      extent.block_type = FILE_EXTENT_TYPE;
+      extent.magic_number = MAGIC_NUMBER;
+
+      // If it's not the last block, link it to the next block
+      blockNumber n = job->built++;
+      if (disk_format != FORMAT_REVISION) {
+         set_extent_next(&extent, n < job->fresh_count - 1 ? job->fresh_start + n + 1 : -1);
+      }
+
+      // Copy the data to the block
+      byteCount offset = job->next_block * extent_data_size;
+      int bytes_to_copy = size - offset > extent_data_size ? extent_data_size : (int)(size - offset);
+      memcpy(extent_data(&extent), buffer + offset, bytes_to_copy);
+      memcpy(run + k * BLOCKSIZE, &extent, BLOCKSIZE);
+      job->next_block++;
+      k++;
+   }
+}
+
+/* Finishes a flush once its data blocks are written, or with written
+failed, gives them back. Contents replaced or deleted while the flusher
+was writing them are dropped the same way. */
+static int flush_commit(FlushJob *job, int written) {
+   PendingWrite *pending = job->pending;
+   int current = pending->data != NULL && pending->seq == job->seq;
+   if (current) {
+      pending->flushing = 0;
+   }
+   if (written != E_SUCCESS || !current) {
+      flush_abandon(job);
+      return written;
+   }
+
+   // Write the updated inode back to the disk, then remove the old blocks
+   // of the file, so the inode never points at blocks already freed. The
+   // old blocks are the inode's now, which tfs_defrag may have moved.
+   inode_t inode;
+   FileMap old_map;
+   if (cache_read_block(pending->inode, &inode) != E_SUCCESS ||
+       file_map_load(&inode, &old_map) != E_SUCCESS) {
+      flush_abandon(job);
+      return E_READ_BLOCK;
+   }
+   inode_t old_inode = inode;
+   inode.file_size = pending->size;
+   int result = file_map_store(&inode, &job->map);
+   if (result == E_SUCCESS && cache_write_block(pending->inode, &inode) != E_SUCCESS) {
+      file_map_release_blocks(&inode);
+      result = E_WRITE_BLOCK; // Error writing block
+   }
+   if (result != E_SUCCESS) {
+      file_map_free(&old_map);
+      flush_abandon(job);
+      return result;
+   }
+   file_map_release(&old_map);
+   file_map_release_blocks(&old_inode);
+   file_map_free(&old_map);
+
+   // The blocks written are indexed once the file owns them
+   for (blockNumber i = 0, d = 0; job->hashes != NULL && i < job->map.count; i++) {
+      MapRun *run = &job->map.runs[i];
+      for (blockNumber b = 0; run->start >= 0 && b < run->count; b++, d++) {
+         if (flush_fresh(job, run)) {
+            dedup_insert(job->hashes[d], run->start + b);
+         }
+      }
+   }
+   file_map_free(&job->map);
+   free(job->hashes);
+   job->hashes = NULL;
+   drop_pending(pending);
+   return E_SUCCESS;
+}
+
+/* Writes pending contents to disk. The final size is known here, so the
+blocks it writes go into one contiguous run. */
+static int flush_entry(PendingWrite *pending) {
+   // Contents the flusher is writing are done once its writes land
+   if (pending->data != NULL && pending->flushing) {
+      flusher_drain();
+   }
+   if (pending->data == NULL) {
+      return E_SUCCESS;
+   }
+   FlushJob job;
+   int result = flush_prepare(pending, &job);
+   if (result != E_SUCCESS) {
+      return result;
+   }
+
+   // Build the file content in the allocated (contiguous) blocks and
+   // write them, WRITE_BATCH_BLOCKS per request, before the inode points
+   // at them
+   blockNumber data_count = job.fresh_count;
+   blockNumber batch_blocks = data_count < WRITE_BATCH_BLOCKS ? data_count : WRITE_BATCH_BLOCKS;
+   char *run = malloc(batch_blocks > 0 ? batch_blocks * BLOCKSIZE : 1);
+   if (run == NULL) {
+      return flush_commit(&job, E_WRITE_FILE);
+   }
+   int written = E_SUCCESS;
+   for (blockNumber n = 0; n < data_count && written == E_SUCCESS; n += batch_blocks) {
+      blockNumber count = data_count - n < batch_blocks ? data_count - n : batch_blocks;
+      flush_build(&job, count, run);
+      written = cache_write_blocks(job.fresh_start + n, count, run);
+   }
+   free(run);
+   return flush_commit(&job, written != E_SUCCESS ? E_WRITE_BLOCK : E_SUCCESS);
+}
+
+/* Writes every file's pending contents to disk. */
+static int flush_all(void) {
+   int result = E_SUCCESS;
+   for (int i = 0; i < MAX_OPEN_FILES; i++) {
+      int flushed = flush_entry(&pending_writes[i]);
+      if (flushed != E_SUCCESS) {
+         result = flushed;
+      }
+   }
+   return result;
+}
+
+/* Writes buffer ‘buffer’ of size ‘size’, which represents an entire
+file’s content, to the file system. Previous content (if any) will be
+completely lost. Sets the file pointer to 0 (the start of file) when
+done. Returns success/error codes.
+The content is only buffered here; blocks are allocated and written on
+tfs_flush, tfs_closeFile, tfs_unmount, or once more than
+DELAYED_WRITE_LIMIT bytes are buffered across all open files. */
+
+static int do_writeFile(fileDescriptor FD, char *buffer, byteCount size) {
+   // Check for a valid file descriptor
+   if (!fd_open(FD) || size < 0) {
+      return E_WRITE_FILE; // Invalid file descriptor
+   }
+   if (size > max_file_size()) {
+      return E_FILE_TOO_BIG; // Revision 1 disks hold files up to 2 GB
+   }
+
+   // This write replaces anything still buffered for the same file. With
+   // every slot taken, the oldest contents are written out to make room.
+   FileEntry *entry = &resource_table[FD];
+   PendingWrite *pending = pending_entry(entry->inode);
+   if (pending != NULL) {
+      drop_pending(pending);
+   }
+   for (int i = 0; pending == NULL && i < MAX_OPEN_FILES; i++) {
+      if (pending_writes[i].data == NULL) {
+         pending = &pending_writes[i];
+      }
+   }
+   if (pending == NULL) {
+      pending = &pending_writes[0];
+      for (int i = 1; i < MAX_OPEN_FILES; i++) {
+         if (pending_writes[i].since < pending->since) {
+            pending = &pending_writes[i];
+         }
+      }
+      int result = flush_entry(pending);
+      if (result != E_SUCCESS) {
+         return result;
+      }
+   }
+
+   pending->data = malloc(size > 0 ? size : 1);
+   if (pending->data == NULL) {
+      return E_WRITE_FILE;
+   }
+   memcpy(pending->data, buffer, size);
+   pending->inode = entry->inode;
+   pending->size = size;
+   pending->since = clock_ns();
+   pending->seq = ++pending_seq;
+   pending->flushing = 0;
+   pending_bytes += size;
+   pending_count++;
+
+   // Rewind and restart access-pattern detection
+   entry->file_pointer = 0;
+   entry->last_block = -1;
+   entry->ra_window = 0;
+   entry->ra_next = 0;
+
+   // Under memory pressure, write everything out now
+   if (pending_bytes > DELAYED_WRITE_LIMIT) {
+      return flush_all();
+   }
    return E_SUCCESS;
 }
 
+/* Forces the buffered contents of a file to disk. */
+static int do_flush(fileDescriptor FD) {
+   // Check for a valid file descriptor
+   if (!fd_open(FD)) {
+      return E_WRITE_FILE; // Invalid file descriptor
+   }
+
+   PendingWrite *pending = pending_entry(resource_table[FD].inode);
+   if (pending == NULL) {
+      return E_SUCCESS; // Nothing buffered
+   }
+   return flush_entry(pending);
+}
+
 /* deletes a file and marks its blocks as free on disk. */
 
-int tfs_deleteFile(fileDescriptor FD) {
+static int do_deleteFile(fileDescriptor FD) {
    // Check for a valid file descriptor
-   if (FD < 0 || FD >= next_fd) {
+   if (!fd_open(FD)) {
       return E_DELETE_FILE; // Invalid file descriptor
    }
 
    // Retrieve the inode number of the file from resource_table
-   int inode_num = resource_table[FD].inode;
+   blockNumber inode_num = resource_table[FD].inode;
+
+   // Contents that never reached the disk are simply discarded
+   PendingWrite *pending = pending_entry(inode_num);
+   if (pending != NULL) {
+      drop_pending(pending);
+   }
+
    inode_t inode;
-   if (readBlock(mounted_disk, inode_num, (char*)&inode) != E_SUCCESS) {
+   if (cache_read_block(inode_num, (char*)&inode) != E_SUCCESS) {
       return E_READ_BLOCK; // Error reading block
    }
 
-   // Traverse the entire file block list and free up each block
-   int current_block = inode.file_extent;
-   file_extent_t file_block;
-   while(current_block != -1){
-      if(readBlock(mounted_disk, current_block, (char*)&file_block) != E_SUCCESS){
-         return E_READ_BLOCK; // Error reading block
+   // Free every data block no other file shares, and the map itself
+   FileMap map;
+   if (file_map_load(&inode, &map) != E_SUCCESS) {
+      return E_READ_BLOCK; // Error reading block
+   }
+   file_map_release(&map);
+   file_map_release_blocks(&inode);
+   file_map_free(&map);
+
+   // Every descriptor open on the file goes stale before the inode block
+   // is freed for the next file created to take
+   for (int i = 0; i < next_fd; i++) {
+      if (resource_table[i].filename != NULL && resource_table[i].inode == inode_num) {
+         resource_table[i].filename = NULL;
+         file_map_free(&resource_table[i].map);
+         resource_table[i].map_generation = -1;
       }
-      freeBlock(current_block);
-      current_block = file_block.next_block;
    }
 
    // Mark the inode block as free
-   // Assume that you have a freeBlock function that marks a block as free
    freeBlock(inode_num);
-
-   resource_table[FD].filename = NULL; // Mark the file as removed from the resource_table
+   name_index_remove(inode.file_name);
 
    return E_SUCCESS; // File deleted successfully
 }
+/* Returns the map of the file open as entry, whose inode is inode, read
+again only once some inode has been written since. NULL on error. */
+static FileMap *entry_map(FileEntry *entry, const inode_t *inode) {
+   if (entry->map_generation != inode_generation) {
+      file_map_free(&entry->map);
+      if (file_map_load(inode, &entry->map) != E_SUCCESS) {
+         entry->map_generation = -1;
+         return NULL;
+      }
+      entry->map_generation = inode_generation;
+   }
+   return &entry->map;
+}
+
 /* reads one byte from the file and copies it to buffer, using the
 current file pointer location and incrementing it by one upon success.
 If the file pointer is already past the end of the file then
 tfs_readByte() should return an error and not increment the file pointer.
 */
-int tfs_readByte(fileDescriptor FD, char *buffer) {
+static int do_readByte(fileDescriptor FD, char *buffer) {
    // Check for a valid file descriptor
-   if (FD < 0 || FD >= next_fd) {
+   if (!fd_open(FD)) {
       return E_READ_FILE; // Invalid file descriptor
    }
 
    // Get the inode of the file
-   int inode_num = resource_table[FD].inode;
+   blockNumber inode_num = resource_table[FD].inode;
    inode_t inode;
-   if (readBlock(mounted_disk, inode_num, &inode) != E_SUCCESS) {
+   if (cache_read_block(inode_num, &inode) != E_SUCCESS) {
       return E_READ_BLOCK; // Error reading block
    }
 
+   // Contents still buffered by tfs_writeFile are read from memory
+   PendingWrite *pending = pending_entry(inode_num);
+   if (pending != NULL) {
+      if (resource_table[FD].file_pointer >= pending->size) {
+         return E_READ_FILE; // Read position is past end of file
+      }
+      *buffer = pending->data[resource_table[FD].file_pointer++];
+      return E_SUCCESS;
+   }
+
    // Check file pointer position
    if (resource_table[FD].file_pointer >= inode.file_size) {
       return E_READ_FILE; // Read position is past end of file
    }
 
-   // Calculate which block to read
-   int block_num = resource_table[FD].file_pointer / BLOCKSIZE;
+   // Calculate which block to read, and find it in the file's map
+   blockNumber block_num = resource_table[FD].file_pointer / extent_data_size;
+   FileEntry *entry = &resource_table[FD];
+   FileMap *map = entry_map(entry, &inode);
+   if (map == NULL) {
+      return E_READ_BLOCK;
+   }
+   blockNumber phys = physical_block(map, block_num);
+
+   // Holes read as zeros without any disk I/O
+   if (phys < 0) {
+      entry->last_block = block_num;
+      *buffer = 0;
+      entry->file_pointer++;
+      return E_SUCCESS;
+   }
+
+   // Crossing into a new block: update the read-ahead window
+   if (block_num != entry->last_block) {
+      if (read_ahead_max == 0) {
+         entry->ra_window = 0;
+      } else if (block_num == entry->last_block + 1) {
+         // Sequential, grow the window; shrink it if the blocks we
+         // prefetched were evicted before they were used
+         if (entry->ra_window == 0) {
+            entry->ra_window = READ_AHEAD_MIN;
+         } else if (block_num < entry->ra_next && !cache_contains(phys)) {
+            entry->ra_window /= 2;
+         } else if (block_num >= entry->ra_next) {
+            entry->ra_window *= 2;
+         }
+         if (entry->ra_window > read_ahead_max) {
+            entry->ra_window = read_ahead_max;
+         }
+      } else {
+         // Random access, fall back to one block at a time
+         entry->ra_window /= 2;
+         entry->ra_next = 0;
+      }
+      entry->last_block = block_num;
+
+      // Prefetch the window once the reader reaches what is already cached
+      if (entry->ra_window > 0 && block_num >= entry->ra_next) {
+         blockNumber last_file_block = (inode.file_size - 1) / extent_data_size;
+         int count = entry->ra_window;
+         if (block_num + count > last_file_block + 1) {
+            count = (int)(last_file_block + 1 - block_num);
+         }
+
+         // Each run of disk blocks in the window is fetched with one
+         // request; holes have no disk blocks to fetch
+         int result = E_SUCCESS;
+         for (blockNumber r = file_map_find(map, block_num); r < map->count && result == E_SUCCESS; r++) {
+            MapRun *run = &map->runs[r];
+            blockNumber first = run->block > block_num ? run->block : block_num;
+            blockNumber end = run->block + run->count < block_num + count ? run->block + run->count : block_num + count;
+            if (first >= end) {
+               break;
+            }
+            if (run->start >= 0) {
+               result = cache_prefetch(run->start + first - run->block, (int)(end - first));
+            }
+         }
+         if (result == E_SUCCESS) {
+            entry->ra_next = block_num + count;
+         }
+      }
+   }
 
    // Read this block
-   char block[BLOCKSIZE];
-   if (readBlock(mounted_disk, inode.file_extent + block_num, block) != E_SUCCESS) {
+   file_extent_t block;
+   if (cache_read_block(phys, &block) != E_SUCCESS) {
       return E_READ_BLOCK; // Error reading block
    }
 
    // Calculate relative position within the block
-   int block_pos = resource_table[FD].file_pointer % BLOCKSIZE;
+   int block_pos = resource_table[FD].file_pointer % extent_data_size;
 
    // Read one byte
-   *buffer = block[block_pos];
+   *buffer = extent_data(&block)[block_pos];
 
    // Increment file pointer
    resource_table[FD].file_pointer++;
@@ -291,27 +1688,79 @@ int tfs_readByte(fileDescriptor FD, char *buffer) {
    return E_SUCCESS; // Return with success
 }
 
-/* change the file pointer location to offset (absolute). Returns
-success/error codes.*/
+/* change the file pointer location to offset (absolute). Seeking past
+the end grows the file with holes; on revision 1 and 2 disks only up to
+MAX_SPARSE_BLOCKS blocks, past which it fails with E_FILE_TOO_BIG.
+Returns success/error codes.*/
 //this should just be a fseek call
-int tfs_seek(fileDescriptor FD, int offset) {
+static int do_seek(fileDescriptor FD, byteCount offset) {
    // Check for a valid file descriptor
-   if(FD < 0 || FD >= next_fd) {
+   if(!fd_open(FD)) {
       return E_SEEK_FILE; // Invalid file descriptor
    }
 
    // Get the inode of the file
-   int inode_num = resource_table[FD].inode;
+   blockNumber inode_num = resource_table[FD].inode;
    inode_t inode;
-   if(readBlock(mounted_disk, inode_num, &inode) != E_SUCCESS) {
+   if(cache_read_block(inode_num, &inode) != E_SUCCESS) {
       return E_READ_BLOCK; // Error reading block
    }
 
    // Check if offset is within the bounds of the file
-   if(offset < 0 || offset > inode.file_size) {
+   PendingWrite *pending = pending_entry(inode_num);
+   byteCount file_size = pending != NULL ? pending->size : inode.file_size;
+   if(offset < 0) {
       return E_SEEK_FILE; // Offset is out of bounds
    }
 
+   // Seeking past the end grows the file with holes, which take no disk
+   // blocks and read back as zeros
+   if(offset > file_size) {
+      blockNumber new_blocks = (offset + extent_data_size - 1) / extent_data_size;
+      if((disk_format != FORMAT_REVISION && new_blocks > MAX_SPARSE_BLOCKS) ||
+         offset > max_file_size()) {
+         return E_FILE_TOO_BIG;
+      }
+      if(pending != NULL) {
+         int result = flush_entry(pending);
+         if(result != E_SUCCESS) {
+            return result;
+         }
+         if(cache_read_block(inode_num, &inode) != E_SUCCESS) {
+            return E_READ_BLOCK;
+         }
+      }
+      FileMap map;
+      if(file_map_load(&inode, &map) != E_SUCCESS) {
+         return E_READ_BLOCK;
+      }
+      inode_t old_inode = inode;
+      int result = file_map_add(&map, -1, new_blocks - file_map_blocks(&map));
+      if(result == E_SUCCESS) {
+         result = file_map_store(&inode, &map);
+      }
+      file_map_free(&map);
+      if(result != E_SUCCESS) {
+         return result;
+      }
+      inode.file_size = offset;
+      if(cache_write_block(inode_num, &inode) != E_SUCCESS) {
+         file_map_release_blocks(&inode);
+         return E_WRITE_BLOCK;
+      }
+      file_map_release_blocks(&old_inode);
+   }
+
+   // A jump away from the current block is random access, so drop the
+   // read-ahead window and start detecting the pattern again
+   blockNumber block_num = offset / extent_data_size;
+   FileEntry *entry = &resource_table[FD];
+   if(block_num != entry->last_block && block_num != entry->last_block + 1) {
+      entry->ra_window = 0;
+      entry->ra_next = 0;
+      entry->last_block = -1;
+   }
+
    // Change the file pointer location to offset
    resource_table[FD].file_pointer = offset;
 
@@ -319,226 +1768,1988 @@ int tfs_seek(fileDescriptor FD, int offset) {
 }
 
 
+typedef struct MappedFile {
+   int count;           // number of entries in iov, -1 if slot unused
+   tfs_iovec_t *iov;
+   CacheBuffer **pinned; // buffer behind each entry, NULL for holes
+} MappedFile;
 
-int find_file(const char* name) {
-   // Traverse some data structure that stores file name to inode mappings
-   // Return the inode if found, -1 if not found
-   // Placeholder return
-   return -1;
-}
-int create_file(const char* name) {
-   // Allocate space for the new file
-   // Create an entry in your file to inode mapping
-   // Return the inode of the new file
-   // Placeholder return
-   return -1;
-}
-int* allocate_blocks(int num_blocks) {
-   // Implement block allocation logic here
-   // Placeholder return
-   return NULL;
-}
-void remove_blocks(int* blocks_start) {
-   // Implement block deallocation logic here
-}
-void freeBlock(int block_number) {
-   // Mark the block as free in your block allocation table
-}
-
-/* TinyFS demo file
- *  * Foaad Khosmood, Cal Poly / modified Winter 2014
- *   */
-
+MappedFile mapped_files[MAX_MAPPINGS];
+int mappings_initialized = 0;
 
-/* simple helper function to fill Buffer with as many inPhrase strings as possible before reaching size */
-int
-fillBufferWithPhrase (char *inPhrase, char *Buffer, int size)
-{
-   int index = 0, i;
-   if (!inPhrase || !Buffer || size <= 0 || size < strlen (inPhrase))
-      return -1;
+// Backing for holes in a mapped file
+static char zero_block[BLOCKSIZE];
 
-   while (index < size)
-   {
-      for (i = 0; inPhrase[i] != '\0' && (i + index < size); i++)
-         Buffer[i + index] = inPhrase[i];
-      index += i;
+/* Maps the contents of an open file for reading without copying. On
+success *iov points at *count entries, one per block of the file in
+order, each pointing straight at the block's data in the cache. The
+blocks stay pinned and unchanged, even if the file is rewritten or the
+disk unmounted, until tfs_unmapFile releases them. The entries must not
+be written through. Returns a mapping handle or an error. */
+static int do_mapFile(fileDescriptor FD, tfs_iovec_t **iov, int *count) {
+   // Check for a valid file descriptor
+   if (!fd_open(FD) || iov == NULL || count == NULL) {
+      return E_MAP_FILE; // Invalid file descriptor
+   }
+   if (!mappings_initialized) {
+      for (int i = 0; i < MAX_MAPPINGS; i++) {
+         mapped_files[i].count = -1;
+      }
+      mappings_initialized = 1;
+   }
+   int handle = 0;
+   while (handle < MAX_MAPPINGS && mapped_files[handle].count >= 0) {
+      handle++;
+   }
+   if (handle == MAX_MAPPINGS) {
+      return E_MAP_FILE; // Too many mappings
    }
-   Buffer[size - 1] = '\0';	/* explicit null termination */
-   return 0;
-}
-
-/* This program will create 2 files (of sizes 200 and 1000) to be read from or stored in the TinyFS file system. */
-/*
-int
-main ()
-{
-   char readBuffer;
-   char *afileContent, *bfileContent;	*/
-/* buffers to store file content *//*
-
-   int afileSize = 200;		*/
-/* sizes in bytes *//*
 
-   int bfileSize = 1000;
+   // Map what is on disk, so write out anything still buffered
+   int result = tfs_flush(FD);
+   if (result != E_SUCCESS) {
+      return result;
+   }
+   inode_t inode;
+   if (cache_read_block(resource_table[FD].inode, &inode) != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
 
-   char phrase1[] = "hello world from (a) file ";
-   char phrase2[] = "(b) file content ";
+   blockNumber file_blocks = (inode.file_size + extent_data_size - 1) / extent_data_size;
+   if (file_blocks > INT_MAX / (int)sizeof(tfs_iovec_t)) {
+      return E_MAP_FILE; // More entries than one array can hold
+   }
+   int num_blocks = (int)file_blocks;
+   FileMap file_map;
+   if (file_map_load(&inode, &file_map) != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+   MappedFile *map = &mapped_files[handle];
+   map->iov = malloc((num_blocks > 0 ? num_blocks : 1) * sizeof(tfs_iovec_t));
+   map->pinned = calloc(num_blocks > 0 ? num_blocks : 1, sizeof(CacheBuffer *));
+   if (map->iov == NULL || map->pinned == NULL) {
+      free(map->iov);
+      free(map->pinned);
+      file_map_free(&file_map);
+      return E_MAP_FILE;
+   }
 
-   fileDescriptor aFD, bFD;
-   int i, returnValue;
+   for (int i = 0; i < num_blocks; i++) {
+      byteCount len = inode.file_size - (byteCount)i * extent_data_size;
+      map->iov[i].len = len > extent_data_size ? extent_data_size : (int)len;
+      blockNumber r = file_map_find(&file_map, i);
+      MapRun *run = r < file_map.count ? &file_map.runs[r] : NULL;
+      if (run == NULL || run->start < 0) {
+         map->iov[i].base = zero_block;
+         continue;
+      }
 
-*/
-/* try to mount the disk *//*
+      // Fetch the rest of the run, up to half the cache, in one request
+      blockNumber phys = run->start + i - run->block;
+      if (!cache_contains(phys)) {
+         blockNumber ahead = run->block + run->count - i;
+         cache_prefetch(phys, ahead < CACHE_BLOCKS / 2 ? (int)ahead : CACHE_BLOCKS / 2);
+      }
+      map->pinned[i] = cache_pin(phys);
+      if (map->pinned[i] == NULL) {
+         map->count = i;
+         tfs_unmapFile(handle);
+         file_map_free(&file_map);
+         return E_READ_BLOCK;
+      }
+      map->iov[i].base = extent_data(map->pinned[i]->data);
+   }
+   file_map_free(&file_map);
 
-   if (tfs_mount (DEFAULT_DISK_NAME) < 0)	*/
-/* if mount fails *//*
+   map->count = num_blocks;
+   *iov = map->iov;
+   *count = num_blocks;
+   return handle;
+}
 
-   {
-      tfs_mkfs (DEFAULT_DISK_NAME, DEFAULT_DISK_SIZE);	*/
-/* then make a new disk *//*
+/* Releases a mapping made by tfs_mapFile. Its entries must not be used
+afterwards. */
+static int do_unmapFile(int handle) {
+   if (handle < 0 || handle >= MAX_MAPPINGS || !mappings_initialized ||
+       mapped_files[handle].count < 0) {
+      return E_MAP_FILE;
+   }
+   MappedFile *map = &mapped_files[handle];
+   for (int i = 0; i < map->count; i++) {
+      cache_unpin(map->pinned[i]);
+   }
+   free(map->pinned);
+   free(map->iov);
+   map->count = -1;
+   return E_SUCCESS;
+}
 
-      if (tfs_mount (DEFAULT_DISK_NAME) < 0)	*/
-/* if we still can't open it... *//*
+/* Reads from the current file pointer into iovcnt buffers in turn,
+filling each before moving to the next, and advances the file pointer.
+Blocks are copied straight from the cache into the caller's buffers.
+Returns the number of bytes read, which is short only at end of file. */
+static int do_readv(fileDescriptor FD, tfs_iovec_t *iov, int iovcnt) {
+   // Check for a valid file descriptor
+   if (!fd_open(FD) || iov == NULL || iovcnt < 0) {
+      return E_READ_FILE; // Invalid file descriptor
+   }
 
-      {
-         perror ("failed to open disk");	*/
-/* then just exit *//*
+   blockNumber inode_num = resource_table[FD].inode;
+   inode_t inode;
+   if (cache_read_block(inode_num, &inode) != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+   FileEntry *entry = &resource_table[FD];
+   PendingWrite *pending = pending_entry(inode_num);
+   byteCount file_size = pending != NULL ? pending->size : inode.file_size;
+   FileMap *map = pending != NULL ? NULL : entry_map(entry, &inode);
+   if (pending == NULL && map == NULL) {
+      return E_READ_BLOCK;
+   }
 
-         return;
+   // The byte count is returned as an int, so stop short of overflowing it
+   int total = 0;
+   for (int v = 0; v < iovcnt && entry->file_pointer < file_size; v++) {
+      int done = 0;
+      while (done < iov[v].len && entry->file_pointer < file_size && total < INT_MAX) {
+         blockNumber block_num = entry->file_pointer / extent_data_size;
+         int block_pos = entry->file_pointer % extent_data_size;
+         int len = extent_data_size - block_pos;
+         if (len > iov[v].len - done) {
+            len = iov[v].len - done;
+         }
+         if (len > file_size - entry->file_pointer) {
+            len = (int)(file_size - entry->file_pointer);
+         }
+         if (len > INT_MAX - total) {
+            len = INT_MAX - total;
+         }
+
+         MapRun *run = NULL;
+         if (pending == NULL && map != NULL) {
+            blockNumber r = file_map_find(map, block_num);
+            run = r < map->count && map->runs[r].start >= 0 ? &map->runs[r] : NULL;
+         }
+         if (pending != NULL) {
+            memcpy(iov[v].base + done, pending->data + entry->file_pointer, len);
+         } else if (run == NULL) {
+            memset(iov[v].base + done, 0, len); // A hole
+         } else {
+            blockNumber phys = run->start + block_num - run->block;
+            if (!cache_contains(phys)) {
+               // Fetch the rest of this request's blocks in the run in one go
+               blockNumber last_block = (entry->file_pointer + iov[v].len - done - 1) / extent_data_size;
+               if (last_block >= run->block + run->count) {
+                  last_block = run->block + run->count - 1;
+               }
+               blockNumber ahead = last_block - block_num + 1;
+               cache_prefetch(phys, ahead < CACHE_BLOCKS / 2 ? (int)ahead : CACHE_BLOCKS / 2);
+            }
+            CacheBuffer *buf = cache_pin(phys);
+            if (buf == NULL) {
+               return total > 0 ? total : E_READ_BLOCK;
+            }
+            memcpy(iov[v].base + done, extent_data(buf->data) + block_pos, len);
+            cache_unpin(buf);
+         }
+         done += len;
+         total += len;
+         entry->file_pointer += len;
       }
    }
+   return total;
+}
 
-
-   afileContent = (char *) malloc (afileSize * sizeof (char));
-   if (fillBufferWithPhrase (phrase1, afileContent, afileSize) < 0)
-   {
-      perror ("failed");
-      return;
+/* Returns the first block of the reference count table, or -1 if the
+disk has none. With create set, a missing table is allocated first. */
+static blockNumber refcount_table(int create) {
+   superblock_t sb;
+   if(cache_read_block(0, &sb) != E_SUCCESS) {
+      return -1;
    }
-
-   bfileContent = (char *) malloc (bfileSize * sizeof (char));
-   if (fillBufferWithPhrase (phrase2, bfileContent, bfileSize) < 0)
-   {
-      perror ("failed");
-      return;
+   blockNumber total_blocks = diskBlocks(mounted_disk);
+   if(sb.refcount_table > 0 && sb.refcount_table < total_blocks) {
+      refcount_block_t table;
+      if(cache_read_block(sb.refcount_table, &table) == E_SUCCESS &&
+         table.block_type == REFCOUNT_TYPE && table.magic_number == MAGIC_NUMBER) {
+         return sb.refcount_table;
+      }
+   }
+   if(!create) {
+      return -1; // Images made before cloning existed have no table
    }
 
-*/
-/* print content of files for debugging *//*
+   blockNumber num_blocks = (total_blocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+   blockNumber *blocks = allocate_blocks(num_blocks);
+   if(blocks == NULL) {
+      return -1;
+   }
+   blockNumber table_start = blocks[0];
+   free(blocks);
+
+   refcount_block_t table;
+   memset(&table, 0, sizeof(table));
+   table.block_type = REFCOUNT_TYPE;
+   table.magic_number = MAGIC_NUMBER;
+   for(blockNumber i = 0; i < num_blocks; i++) {
+      if(cache_write_block(table_start + i, &table) != E_SUCCESS) {
+         return -1;
+      }
+   }
 
-   printf
-      ("(a) File content: %s\n(b) File content: %s\nReady to store in TinyFS\n",
-       afileContent, bfileContent);
+   // allocate_blocks rewrote the superblock, so read it again
+   if(cache_read_block(0, &sb) != E_SUCCESS) {
+      return -1;
+   }
+   sb.refcount_table = table_start;
+   if(cache_write_block(0, &sb) != E_SUCCESS) {
+      return -1;
+   }
+   return table_start;
+}
 
+/* Returns how many files share bNum beyond its first owner. */
+static int block_refs(blockNumber bNum) {
+   blockNumber table_start = refcount_table(0);
+   if(table_start < 0) {
+      return 0;
+   }
+   refcount_block_t table;
+   if(cache_read_block(table_start + bNum / REFCOUNTS_PER_BLOCK, &table) != E_SUCCESS) {
+      return 0;
+   }
+   return table.counts[bNum % REFCOUNTS_PER_BLOCK];
+}
 
-*/
-/* read or write files to TinyFS *//*
+/* Adds delta to the share count of count blocks starting at bNum. Every
+count is checked before any table block is written, so a count that
+would leave 0..MAX_BLOCK_REFS changes nothing; a failed write puts back
+the table blocks already written. */
+static int add_block_refs(blockNumber bNum, blockNumber count, int delta) {
+   blockNumber table_start = refcount_table(delta > 0);
+   if(table_start < 0) {
+      return delta > 0 ? E_CLONE_FILE : E_SUCCESS;
+   }
+   refcount_block_t table;
+   for(blockNumber b = bNum; b < bNum + count; ) {
+      if(cache_read_block(table_start + b / REFCOUNTS_PER_BLOCK, &table) != E_SUCCESS) {
+         return E_READ_BLOCK;
+      }
+      do {
+         int refs = table.counts[b % REFCOUNTS_PER_BLOCK] + delta;
+         if(refs < 0 || refs > MAX_BLOCK_REFS) {
+            return E_CLONE_FILE;
+         }
+         b++;
+      } while(b < bNum + count && b % REFCOUNTS_PER_BLOCK != 0);
+   }
 
+   // Each table block is read and written once however many counts it holds
+   for(blockNumber b = bNum; b < bNum + count; ) {
+      blockNumber first = b;
+      blockNumber table_block = table_start + b / REFCOUNTS_PER_BLOCK;
+      if(cache_read_block(table_block, &table) != E_SUCCESS) {
+         add_block_refs(bNum, first - bNum, -delta);
+         return E_READ_BLOCK;
+      }
+      do {
+         table.counts[b % REFCOUNTS_PER_BLOCK] += delta;
+         b++;
+      } while(b < bNum + count && b % REFCOUNTS_PER_BLOCK != 0);
+      if(cache_write_block(table_block, &table) != E_SUCCESS) {
+         add_block_refs(bNum, first - bNum, -delta);
+         return E_WRITE_BLOCK;
+      }
+   }
+   return E_SUCCESS;
+}
 
+// The mounted disk's dedup index, read in by the first flush with dedup on
+// and written back by the flusher, tfs_sync and tfs_unmount
+dedup_block_t *dedup_table = NULL;
+char *dedup_dirty = NULL; // index blocks changed since they were written
+blockNumber dedup_table_start = -1;
+blockNumber dedup_table_blocks = 0;
+tfs_dedup_stats_t dedup_stats;
+
+/* Hashes the data of one data block, a word at a time. */
+static unsigned long long dedup_hash(const char *data) {
+   unsigned long long hash = 0x9E3779B97F4A7C15ULL;
+   for(int i = 0; i < extent_data_size; i += 8) {
+      unsigned long long word = 0;
+      memcpy(&word, data + i, extent_data_size - i < 8 ? extent_data_size - i : 8);
+      hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+      hash ^= hash >> 29;
+   }
+   hash ^= hash >> 33;
+   hash *= 0xC4CEB9FE1A85EC53ULL;
+   return hash ^ (hash >> 33);
+}
 
-   aFD = tfs_openFile ("afile");
+/* Copies block block_num of a file's contents into data the way an
+extent holds it, zero filled past the end of the file. */
+static void block_payload(const char *buffer, byteCount size, blockNumber block_num, char *data) {
+   byteCount offset = block_num * extent_data_size;
+   byteCount length = size - offset > extent_data_size ? extent_data_size : size - offset;
+   memset(data, 0, extent_data_size);
+   memcpy(data, buffer + offset, length);
+}
 
-   if (aFD < 0)
-   {
-      perror ("tfs_openFile failed on afile");
+/* Writes the index blocks marked dirty, a run at a time. */
+static void dedup_writeback(void) {
+   for(blockNumber i = 0; dedup_table != NULL && i < dedup_table_blocks; i++) {
+      if(!dedup_dirty[i]) {
+         continue;
+      }
+      blockNumber run = 1;
+      while(i + run < dedup_table_blocks && run < WRITE_BATCH_BLOCKS && dedup_dirty[i + run]) {
+         run++;
+      }
+      if(cache_write_blocks(dedup_table_start + i, run, (char *)&dedup_table[i]) == E_SUCCESS) {
+         memset(dedup_dirty + i, 0, run);
+      }
+      i += run - 1;
    }
+}
 
-*/
-/* now, was there already a file named "afile" that had some content? If we can read from it, yes!
- *  * If we can't read from it, it presumably means the file was empty.
- *   * If the size is 0 (all new files are sized 0) then any "readByte()" should fail, so
- *    * it's a new file and empty *//*
+/* Forgets the index of the disk being unmounted, and its counters. */
+static void dedup_reset(void) {
+   free(dedup_table);
+   free(dedup_dirty);
+   dedup_table = NULL;
+   dedup_dirty = NULL;
+   dedup_table_start = -1;
+   dedup_table_blocks = 0;
+   memset(&dedup_stats, 0, sizeof(dedup_stats));
+}
 
-   if (tfs_readByte (aFD, &readBuffer) < 0)
-   {
-      */
-/* if readByte() fails, there was no afile, so we write to it *//*
+/* Reads the dedup index into memory, creating it if the disk has none
+yet. */
+static int dedup_load(void) {
+   if(dedup_table != NULL) {
+      return E_SUCCESS;
+   }
+   superblock_t sb;
+   if(cache_read_block(0, &sb) != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+   blockNumber total_blocks = diskBlocks(mounted_disk);
+   blockNumber count = (total_blocks + DEDUP_INDEX_RATIO - 1) / DEDUP_INDEX_RATIO;
+   dedup_block_t *table = malloc(count * sizeof(dedup_block_t));
+   char *dirty = calloc(count, 1);
+   if(table == NULL || dirty == NULL) {
+      free(table);
+      free(dirty);
+      return E_DEDUP;
+   }
 
-      if (tfs_writeFile (aFD, afileContent, afileSize) < 0)
-      {
-         perror ("tfs_writeFile failed");
+   // Only dedup_writeback writes the index, and it writes through to the
+   // disk, so one large read gets all of it
+   int result = E_SUCCESS;
+   if(sb.dedup_index > 0 && sb.dedup_index + count <= total_blocks &&
+      disk_read(sb.dedup_index, count, table) == E_SUCCESS &&
+      table[0].block_type == DEDUP_TYPE && table[0].magic_number == MAGIC_NUMBER) {
+      dedup_table_start = sb.dedup_index;
+   } else {
+      blockNumber *blocks = allocate_blocks(count);
+      if(blocks == NULL) {
+         result = E_DISK_FULL;
+         goto done;
       }
-      else
-         printf ("Successfully written to afile\n");
-
+      dedup_table_start = blocks[0];
+      free(blocks);
+      memset(table, 0, count * sizeof(dedup_block_t));
+      for(blockNumber i = 0; i < count; i++) {
+         table[i].block_type = DEDUP_TYPE;
+         table[i].magic_number = MAGIC_NUMBER;
+      }
+      memset(dirty, 1, count);
 
+      // allocate_blocks rewrote the superblock, so read it again
+      if(cache_read_block(0, &sb) != E_SUCCESS) {
+         result = E_READ_BLOCK;
+         goto done;
+      }
+      sb.dedup_index = dedup_table_start;
+      if(cache_write_block(0, &sb) != E_SUCCESS) {
+         result = E_WRITE_BLOCK;
+         goto done;
+      }
    }
-   else
-   {
-      */
-/* if yes, then just read and print the rest of afile that was already there *//*
-
-      printf ("\n*** reading afile from TinyFS: \n%c", readBuffer);	*/
-/* print the first byte already read *//*
+   dedup_table = table;
+   dedup_dirty = dirty;
+   dedup_table_blocks = count;
 
-      */
-/* now print the rest of it, byte by byte *//*
+   // A new index goes out at once so the superblock never names blocks
+   // that don't hold one
+   dedup_writeback();
+   return E_SUCCESS;
 
-      while (tfs_readByte (aFD, &readBuffer) >= 0)	*/
-/* go until readByte fails *//*
+done:
+   free(table);
+   free(dirty);
+   return result;
+}
 
-         printf ("%c", readBuffer);
+/* Returns the index slot for hash. */
+static blockNumber dedup_slot(unsigned long long hash) {
+   return (blockNumber)(hash % (unsigned long long)(dedup_table_blocks * DEDUP_ENTRIES_PER_BLOCK));
+}
 
-      */
-/* close file *//*
+static dedup_entry_t *dedup_entry(blockNumber slot) {
+   return &dedup_table[slot / DEDUP_ENTRIES_PER_BLOCK].entries[slot % DEDUP_ENTRIES_PER_BLOCK];
+}
 
-      if (tfs_closeFile (aFD) < 0)
-         perror ("tfs_closeFile failed");
+/* Looks for a data block already on disk holding exactly data, whose
+hash is hash. Blocks the flusher is still writing are left alone, as are
+blocks freed since they were indexed. Returns the block, or -1; the
+caller adds the reference. */
+static blockNumber dedup_share(const char *data, unsigned long long hash) {
+   dedup_entry_t *entry = dedup_entry(dedup_slot(hash));
+   blockNumber block = entry->block;
+   if(entry->hash != hash || block <= 0 || block >= diskBlocks(mounted_disk) ||
+      free_space_contains(block)) {
+      return -1;
+   }
+   for(int k = 0; k < flush_job_count; k++) {
+      if(block >= flush_jobs[k].fresh_start &&
+         block < flush_jobs[k].fresh_start + flush_jobs[k].fresh_count) {
+         return -1;
+      }
+   }
 
-      */
-/* now try to delete the file. It should fail because aFD is no longer valid *//*
+   // The slot is only a hint: compare the block. Files shared once tend
+   // to share on, so the blocks after it are fetched with it.
+   if(!cache_contains(block)) {
+      blockNumber ahead = diskBlocks(mounted_disk) - block;
+      cache_prefetch(block, ahead < READ_AHEAD_MAX ? (int)ahead : READ_AHEAD_MAX);
+   }
+   data_block_t stored;
+   if(cache_read_block(block, &stored) != E_SUCCESS ||
+      stored.block_type != FILE_EXTENT_TYPE || stored.magic_number != MAGIC_NUMBER ||
+      memcmp(stored.data, data, extent_data_size) != 0) {
+      return -1;
+   }
+   return block;
+}
 
-      if (tfs_deleteFile (aFD) < 0)
-      {
-         aFD = tfs_openFile ("afile");	*/
-/* so we open it again *//*
+/* Records a newly written data block in the index under its hash. */
+static void dedup_insert(unsigned long long hash, blockNumber block) {
+   if(!dedup_enabled || dedup_table == NULL) {
+      return;
+   }
+   blockNumber slot = dedup_slot(hash);
+   dedup_entry_t *entry = dedup_entry(slot);
+   entry->hash = hash;
+   entry->block = block;
+   dedup_dirty[slot / DEDUP_ENTRIES_PER_BLOCK] = 1;
+}
 
-         if (tfs_deleteFile (aFD) < 0)
-            perror ("tfs_deleteFile failed");
+/* Counts a file flushed with dedup on, of which shared of its blocks
+were shared. */
+static void dedup_count(blockNumber blocks, blockNumber shared) {
+   dedup_stats.files++;
+   dedup_stats.blocks += blocks;
+   dedup_stats.files_shared += shared > 0;
+   dedup_stats.blocks_shared += shared;
+}
 
-      }
-      else
-         perror ("tfs_deleteFile should have failed");
+/* Turns dedup on or off for later file flushes. Returns success/error
+codes. */
+static int do_dedup(int enabled) {
+   dedup_enabled = enabled != 0;
+   if(!dedup_enabled && mounted_disk >= 0) {
+      dedup_writeback();
+   }
+   return E_SUCCESS;
+}
 
+/* Copies the dedup counters for the mounted disk into stats. */
+static int do_dedupStats(tfs_dedup_stats_t *stats) {
+   if(mounted_disk < 0) {
+      return E_NO_MOUNTED_DISK;
+   }
+   if(stats == NULL) {
+      return E_DEDUP;
    }
+   *stats = dedup_stats;
+   return E_SUCCESS;
+}
 
-*/
-/* now bfile tests *//*
+/* Creates newName as a copy of the file open as srcFD and opens it. The
+copy gets its own inode but shares the source's data blocks, so only the
+inode and the reference counts are written; a later tfs_writeFile on
+either file gives that file new blocks and leaves the other untouched.
+Returns the new file's descriptor or an error. */
+static fileDescriptor do_cloneFile(fileDescriptor srcFD, char *newName) {
+   // Check for a valid file descriptor
+   if (!fd_open(srcFD)) {
+      return E_CLONE_FILE; // Invalid file descriptor
+   }
+   if (find_file(newName) >= 0) {
+      return E_FILE_ALREADY_EXISTS;
+   }
+   if (next_fd >= MAX_OPEN_FILES) {
+      return E_OPEN_FILE; // No available entry in resource table
+   }
 
-   bFD = tfs_openFile ("bfile");
+   // Share what is on disk, so write out anything still buffered
+   int result = tfs_flush(srcFD);
+   if (result != E_SUCCESS) {
+      return result;
+   }
 
-   if (bFD < 0)
-   {
-      perror ("tfs_openFile failed on bfile");
+   inode_t inode;
+   if (cache_read_block(resource_table[srcFD].inode, &inode) != E_SUCCESS) {
+      return E_READ_BLOCK;
    }
 
-   if (tfs_readByte (bFD, &readBuffer) < 0)
-   {
-      if (tfs_writeFile (bFD, bfileContent, bfileSize) < 0)
-      {
-         perror ("tfs_writeFile failed");
-      }
-      else
-         printf ("Successfully written to bfile\n");
+   // The counts go up a run at a time, so a contiguous file costs a
+   // single table block write
+   FileMap map;
+   if (file_map_load(&inode, &map) != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+   result = file_map_add_refs(&map, 1);
+   if (result != E_SUCCESS) {
+      file_map_free(&map);
+      return result;
    }
-   else
-   {
-      printf ("\n*** reading bfile from TinyFS: \n%c", readBuffer);
-      while (tfs_readByte (bFD, &readBuffer) >= 0)
-         printf ("%c", readBuffer);
 
-      tfs_deleteFile (bFD);
+   // The copy gets map blocks of its own, if the map needs any
+   blockNumber inode_num = create_file(newName);
+   if (inode_num < 0) {
+      file_map_add_refs(&map, -1);
+      file_map_free(&map);
+      return (int)inode_num;
+   }
+   strncpy(inode.file_name, newName, sizeof(inode.file_name) - 1);
+   inode.file_name[sizeof(inode.file_name) - 1] = '\0';
+   result = file_map_store(&inode, &map);
+   if (result == E_SUCCESS && cache_write_block(inode_num, &inode) != E_SUCCESS) {
+      file_map_release_blocks(&inode);
+      result = E_WRITE_BLOCK;
    }
+   if (result != E_SUCCESS) {
+      file_map_add_refs(&map, -1);
+      file_map_free(&map);
+      // Take back the file create_file made so the name can be used again
+      name_index_remove(newName);
+      freeBlock(inode_num);
+      return result;
+   }
+   file_map_free(&map);
+   return tfs_openFile(newName);
+}
 
-*/
-/* Free both content buffers *//*
+typedef struct FreeExtent {
+   blockNumber start;
+   blockNumber count;
+} FreeExtent;
+
+// The mounted disk's free blocks as runs in ascending order, read from the
+// free list by the first allocation or free after mounting. The list on
+// disk is kept in the same order: each free block links to the one after
+// it and the last block of a run to the first block of the next run, so
+// taking or returning a run only rewrites the link that leads to it.
+FreeExtent *free_extents = NULL;
+blockNumber free_extent_count = 0;
+blockNumber free_extent_room = 0;
+int free_extents_loaded = 0;
+
+/* Forgets the free runs of the disk being unmounted. */
+static void free_space_reset(void) {
+   free(free_extents);
+   free_extents = NULL;
+   free_extent_count = 0;
+   free_extent_room = 0;
+   free_extents_loaded = 0;
+}
 
-   free (bfileContent);
-   free (afileContent);
-   if (tfs_unmount () < 0)
-      perror ("tfs_unmount failed");
+/* Inserts a free run at index i of free_extents. */
+static int free_space_insert(blockNumber i, blockNumber start, blockNumber count) {
+   if(free_extent_count == free_extent_room) {
+      blockNumber room = free_extent_room > 0 ? free_extent_room * 2 : 64;
+      FreeExtent *extents = realloc(free_extents, room * sizeof(FreeExtent));
+      if(extents == NULL) {
+         return E_DISK_FULL;
+      }
+      free_extents = extents;
+      free_extent_room = room;
+   }
+   memmove(&free_extents[i + 1], &free_extents[i], (free_extent_count - i) * sizeof(FreeExtent));
+   free_extents[i].start = start;
+   free_extents[i].count = count;
+   free_extent_count++;
+   return E_SUCCESS;
+}
 
-   printf ("\nend of demo\n\n");
-   return 0;
-}*/
+static void free_space_remove(blockNumber i) {
+   memmove(&free_extents[i], &free_extents[i + 1], (free_extent_count - i - 1) * sizeof(FreeExtent));
+   free_extent_count--;
+}
+
+/* Returns the index of the first free run starting after bNum, or
+free_extent_count if there is none. */
+static blockNumber free_space_after(blockNumber bNum) {
+   blockNumber low = 0;
+   blockNumber high = free_extent_count;
+   while(low < high) {
+      blockNumber mid = low + (high - low) / 2;
+      if(free_extents[mid].start <= bNum) {
+         low = mid + 1;
+      } else {
+         high = mid;
+      }
+   }
+   return low;
+}
+
+/* Returns whether bNum is on the free list. */
+static int free_space_contains(blockNumber bNum) {
+   blockNumber i = free_space_after(bNum);
+   return i > 0 && bNum < free_extents[i - 1].start + free_extents[i - 1].count;
+}
+
+/* Points the free list link that leads to run i at next: the superblock's
+for the first run, otherwise the one in the last block of run i - 1. */
+static int free_space_link(blockNumber i, blockNumber next) {
+   if(i == 0) {
+      superblock_t sb;
+      if(cache_read_block(0, &sb) != E_SUCCESS) {
+         return E_READ_BLOCK;
+      }
+      sb.free_block_list = next;
+      return cache_write_block(0, &sb);
+   }
+   free_block_t free_block;
+   memset(&free_block, 0, sizeof(free_block));
+   free_block.block_type = FREE_BLOCK_TYPE;
+   free_block.magic_number = MAGIC_NUMBER;
+   free_block.next_free_block = next;
+   return cache_write_block(free_extents[i - 1].start + free_extents[i - 1].count - 1, &free_block);
+}
+
+static int compare_free_extents(const void *a, const void *b) {
+   blockNumber x = ((const FreeExtent *)a)->start;
+   blockNumber y = ((const FreeExtent *)b)->start;
+   return x < y ? -1 : x > y;
+}
+
+/* Sorts free_extents, merging runs that touch, and writes the free list
+out again in that order. Only lists written before the list was kept in
+order need this, and only once. */
+static int free_space_relink(superblock_t *sb) {
+   qsort(free_extents, free_extent_count, sizeof(FreeExtent), compare_free_extents);
+   blockNumber runs = 0;
+   for(blockNumber i = 0; i < free_extent_count; i++) {
+      FreeExtent *last = runs > 0 ? &free_extents[runs - 1] : NULL;
+      blockNumber end = free_extents[i].start + free_extents[i].count;
+      if(last == NULL || free_extents[i].start > last->start + last->count) {
+         free_extents[runs++] = free_extents[i];
+      } else if(end > last->start + last->count) {
+         last->count = end - last->start;
+      }
+   }
+   free_extent_count = runs;
+   for(blockNumber i = 0; i < runs; i++) {
+      blockNumber next = i + 1 < runs ? free_extents[i + 1].start : -1;
+      if(write_free_links(free_extents[i].start, free_extents[i].count, next) != E_SUCCESS) {
+         return E_WRITE_BLOCK;
+      }
+   }
+   sb->free_block_list = runs > 0 ? free_extents[0].start : -1;
+   return cache_write_block(0, sb);
+}
+
+/* Reads the mounted disk's free list into free_extents, if that hasn't
+been done since it was mounted. */
+static int free_space_load(void) {
+   if(free_extents_loaded) {
+      return E_SUCCESS;
+   }
+   superblock_t sb;
+   if(cache_read_block(0, &sb) != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+   blockNumber total_blocks = diskBlocks(mounted_disk);
+   char *batch = malloc(WRITE_BATCH_BLOCKS * BLOCKSIZE);
+   if(batch == NULL) {
+      return E_READ_BLOCK;
+   }
+   free_extent_count = 0;
+
+   // Consecutive blocks are read a batch at a time, past the cache, so a
+   // long list neither costs a request per block nor flushes the cache
+   int result = E_SUCCESS;
+   int sorted = 1;
+   blockNumber batch_start = 0;
+   blockNumber batch_count = 0;
+   blockNumber prev = -1;
+   blockNumber visited = 0;
+   blockNumber current = sb.free_block_list;
+   while(current > 0 && current < total_blocks && visited++ < total_blocks) {
+      free_block_t free_block;
+      int batched = !cache_contains(current) && current >= batch_start && current < batch_start + batch_count;
+      if(!batched && !cache_contains(current) && current == prev + 1) {
+         batch_start = current;
+         batch_count = total_blocks - current < WRITE_BATCH_BLOCKS ? total_blocks - current : WRITE_BATCH_BLOCKS;
+         if(disk_read(batch_start, batch_count, batch) != E_SUCCESS) {
+            result = E_READ_BLOCK;
+            break;
+         }
+         batched = 1;
+      }
+      if(batched) {
+         decode_block(batch + (current - batch_start) * BLOCKSIZE, &free_block);
+         decode_discarded(current, &free_block);
+      } else if(cache_read_block(current, &free_block) != E_SUCCESS) {
+         result = E_READ_BLOCK;
+         break;
+      }
+
+      FreeExtent *last = free_extent_count > 0 ? &free_extents[free_extent_count - 1] : NULL;
+      if(last != NULL && last->start + last->count == current) {
+         last->count++;
+      } else if(free_space_insert(free_extent_count, current, 1) != E_SUCCESS) {
+         result = E_READ_BLOCK;
+         break;
+      }
+      if(free_block.next_free_block != -1 && free_block.next_free_block <= current) {
+         sorted = 0;
+      }
+      prev = current;
+      current = free_block.next_free_block;
+   }
+   free(batch);
+   if(result == E_SUCCESS && !sorted) {
+      result = free_space_relink(&sb);
+   }
+   if(result != E_SUCCESS) {
+      free_extent_count = 0;
+      return result;
+   }
+   free_extents_loaded = 1;
+   return E_SUCCESS;
+}
+
+/* Takes count blocks off the front of free run i, which must hold that
+many. Returns the first block taken, or -1. */
+static blockNumber free_space_take_run(blockNumber i, blockNumber count) {
+   // Whatever is left of the run, or else the next run, now follows the
+   // link that led to this one
+   FreeExtent *run = &free_extents[i];
+   blockNumber start = run->start;
+   blockNumber next = run->count > count ? start + count
+                    : i + 1 < free_extent_count ? free_extents[i + 1].start : -1;
+   if(free_space_link(i, next) != E_SUCCESS) {
+      free_extents_loaded = 0; // Read the list again rather than trust this
+      return -1;
+   }
+   if(run->count > count) {
+      run->start += count;
+      run->count -= count;
+   } else {
+      free_space_remove(i);
+   }
+   discard_forget(start, count);
+   return start;
+}
+
+/* Takes the first run of count free blocks off the free list. Returns the
+first block of the run, or -1 if no run is that long. */
+static blockNumber free_space_take(blockNumber count) {
+   if(count <= 0 || free_space_load() != E_SUCCESS) {
+      return -1;
+   }
+   for(blockNumber i = 0; i < free_extent_count; i++) {
+      if(free_extents[i].count >= count) {
+         return free_space_take_run(i, count);
+      }
+   }
+   return -1;
+}
+
+typedef struct NameEntry {
+   char name[9];
+   blockNumber inode; // 0 if the slot was never used, -1 if its file was deleted
+} NameEntry;
+
+// File names of the mounted disk and their inodes, in a hash table with
+// linear probing. Filled by one scan of the disk on the first lookup after
+// mounting and kept up to date by create_file and tfs_deleteFile, so
+// opening a file never scans the disk again.
+NameEntry *name_index = NULL;
+blockNumber name_index_room = 0; // slots, a power of two
+blockNumber name_index_used = 0; // slots ever used, deleted ones included
+int name_index_loaded = 0;
+
+/* Forgets the names of the disk being unmounted. */
+static void name_index_reset(void) {
+   free(name_index);
+   name_index = NULL;
+   name_index_room = 0;
+   name_index_used = 0;
+   name_index_loaded = 0;
+}
+
+/* Returns the slot holding name, or the empty slot it would go in. */
+static NameEntry *name_index_slot(const char *name) {
+   unsigned long long hash = 0xCBF29CE484222325ULL;
+   for(int i = 0; i < 8 && name[i] != '\0'; i++) {
+      hash = (hash ^ (unsigned char)name[i]) * 0x100000001B3ULL;
+   }
+   NameEntry *reuse = NULL;
+   for(blockNumber i = hash & (name_index_room - 1); ; i = (i + 1) & (name_index_room - 1)) {
+      NameEntry *entry = &name_index[i];
+      if(entry->inode == 0) {
+         return reuse != NULL ? reuse : entry;
+      }
+      if(entry->inode < 0) {
+         if(reuse == NULL) reuse = entry;
+      } else if(strncmp(entry->name, name, 8) == 0) {
+         return entry;
+      }
+   }
+}
+
+/* Records that name's inode is inode_num, growing the table to keep it at
+most half full. */
+static int name_index_add(const char *name, blockNumber inode_num) {
+   if((name_index_used + 1) * 2 > name_index_room) {
+      NameEntry *old = name_index;
+      blockNumber old_room = name_index_room;
+      blockNumber room = name_index_room > 0 ? name_index_room * 2 : 64;
+      name_index = calloc(room, sizeof(NameEntry));
+      if(name_index == NULL) {
+         name_index = old;
+         return E_CREATE_FILE;
+      }
+      name_index_room = room;
+      name_index_used = 0;
+      for(blockNumber i = 0; i < old_room; i++) {
+         if(old[i].inode > 0) {
+            *name_index_slot(old[i].name) = old[i];
+            name_index_used++;
+         }
+      }
+      free(old);
+   }
+   NameEntry *entry = name_index_slot(name);
+   if(entry->inode == 0) {
+      name_index_used++;
+   }
+   memset(entry->name, 0, sizeof(entry->name));
+   strncpy(entry->name, name, 8);
+   entry->inode = inode_num;
+   return E_SUCCESS;
+}
+
+/* Drops name from the index once its file is deleted. */
+static void name_index_remove(const char *name) {
+   if(!name_index_loaded || name_index_room == 0) {
+      return;
+   }
+   NameEntry *entry = name_index_slot(name);
+   if(entry->inode > 0) {
+      entry->inode = -1;
+   }
+}
+
+/* Finds every inode on the mounted disk, if that hasn't been done since
+it was mounted. Blocks on the free list are skipped and the rest read a
+batch at a time past the cache, so the scan neither costs a request per
+block nor flushes the cache. */
+static int name_index_load(void) {
+   if(name_index_loaded) {
+      return E_SUCCESS;
+   }
+   if(free_space_load() != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+   char *batch = malloc(WRITE_BATCH_BLOCKS * BLOCKSIZE);
+   if(batch == NULL) {
+      return E_READ_BLOCK;
+   }
+   blockNumber total_blocks = diskBlocks(mounted_disk);
+   int result = E_SUCCESS;
+   blockNumber next_free = 0;
+   for(blockNumber b = 1; b < total_blocks && result == E_SUCCESS; ) {
+      // Jump over the free run b falls in
+      while(next_free < free_extent_count &&
+            free_extents[next_free].start + free_extents[next_free].count <= b) {
+         next_free++;
+      }
+      if(next_free < free_extent_count && free_extents[next_free].start <= b) {
+         b = free_extents[next_free].start + free_extents[next_free].count;
+         continue;
+      }
+      blockNumber end = next_free < free_extent_count ? free_extents[next_free].start : total_blocks;
+      blockNumber count = end - b < WRITE_BATCH_BLOCKS ? end - b : WRITE_BATCH_BLOCKS;
+      if(disk_read(b, count, batch) != E_SUCCESS) {
+         result = E_READ_BLOCK;
+         break;
+      }
+      for(blockNumber i = 0; i < count; i++) {
+         inode_t inode;
+         if(cache_contains(b + i)) {
+            if(cache_read_block(b + i, &inode) != E_SUCCESS) {
+               result = E_READ_BLOCK;
+               break;
+            }
+         } else {
+            decode_block(batch + i * BLOCKSIZE, &inode);
+         }
+         if(inode.block_type == INODE_TYPE && inode.magic_number == MAGIC_NUMBER &&
+            name_index_add(inode.file_name, b + i) != E_SUCCESS) {
+            result = E_READ_BLOCK;
+            break;
+         }
+      }
+      b += count;
+   }
+   free(batch);
+   if(result != E_SUCCESS) {
+      name_index_reset();
+      return result;
+   }
+   name_index_loaded = 1;
+   return E_SUCCESS;
+}
+
+// Where tfs_defrag carries on: passes sweep the files in inode order,
+// each starting at the lowest inode the last one did not get to
+blockNumber defrag_cursor = 1;
+int defrag_sweep_moved = 0; // whether the current sweep has moved anything
+
+/* Starts the next tfs_defrag pass on a new sweep. */
+static void defrag_reset(void) {
+   defrag_cursor = 1;
+   defrag_sweep_moved = 0;
+}
+
+/* Returns the lowest inode at or after block from, or -1 past the last. */
+static blockNumber defrag_next_inode(blockNumber from) {
+   blockNumber next = -1;
+   for(blockNumber i = 0; i < name_index_room; i++) {
+      blockNumber inode_num = name_index[i].inode;
+      if(inode_num >= from && (next < 0 || inode_num < next)) {
+         next = inode_num;
+      }
+   }
+   return next;
+}
+
+/* Returns the index of the smallest free run of at least count blocks
+that doesn't touch the count blocks at start, or -1 if there is none. */
+static blockNumber defrag_best_fit(blockNumber start, blockNumber count) {
+   blockNumber best = -1;
+   for(blockNumber i = 0; i < free_extent_count; i++) {
+      const FreeExtent *run = &free_extents[i];
+      if(run->count < count || run->start + run->count == start || run->start == start + count) {
+         continue;
+      }
+      if(best < 0 || run->count < free_extents[best].count) {
+         best = i;
+      }
+   }
+   return best;
+}
+
+/* Returns how much moving the count blocks at start to the front of free
+run i, which doesn't touch them, lengthens the free runs: the change in
+the sum of their squared lengths. Moves that score above zero merge more
+free space than they split, so compaction always comes to an end. */
+static long long defrag_gain(blockNumber start, blockNumber count, blockNumber i) {
+   blockNumber after = free_space_after(start);
+   long long left = after > 0 && free_extents[after - 1].start + free_extents[after - 1].count == start
+                    ? free_extents[after - 1].count : 0;
+   long long right = after < free_extent_count && free_extents[after].start == start + count
+                     ? free_extents[after].count : 0;
+   long long n = count;
+   return 2 * n * (n + left + right - free_extents[i].count) + 2 * left * right;
+}
+
+/* Copies the data blocks of the file whose inode is inode_num to the
+num_blocks blocks at new_start, in file order, and points the inode at
+them; the blocks the file had are freed once nothing refers to them. */
+static int defrag_move_data(blockNumber inode_num, inode_t *inode, const FileMap *map,
+                            blockNumber new_start, blockNumber num_blocks) {
+   cache_forget(new_start, num_blocks);
+   FileMap new_map;
+   memset(&new_map, 0, sizeof(new_map));
+   inode_t old_inode = *inode;
+   int result = E_SUCCESS;
+   blockNumber n = 0;
+   for(blockNumber i = 0; i < map->count && result == E_SUCCESS; i++) {
+      const MapRun *run = &map->runs[i];
+      result = file_map_add(&new_map, run->start < 0 ? -1 : new_start + n, run->count);
+      for(blockNumber b = 0; run->start >= 0 && b < run->count && result == E_SUCCESS; b++, n++) {
+         file_extent_t extent;
+         if(cache_read_block(run->start + b, &extent) != E_SUCCESS) {
+            result = E_READ_BLOCK;
+            break;
+         }
+
+         // Revisions that link data blocks relink them in block order
+         extent.block_type = FILE_EXTENT_TYPE;
+         extent.magic_number = MAGIC_NUMBER;
+         if(disk_format != FORMAT_REVISION) {
+            set_extent_next(&extent, (n < num_blocks - 1) ? new_start + n + 1 : -1);
+         }
+         if(cache_write_block(new_start + n, &extent) != E_SUCCESS) {
+            result = E_WRITE_BLOCK;
+         }
+      }
+   }
+
+   // Switching the map is a single inode write, so readers see either
+   // the complete old blocks or the complete new ones
+   if(result == E_SUCCESS) {
+      result = file_map_store(inode, &new_map);
+      if(result == E_SUCCESS && cache_write_block(inode_num, inode) != E_SUCCESS) {
+         file_map_release_blocks(inode);
+         result = E_WRITE_BLOCK;
+      }
+   }
+   file_map_free(&new_map);
+   if(result != E_SUCCESS) {
+      *inode = old_inode;
+      free_run(new_start, num_blocks);
+      return result;
+   }
+   file_map_release(map);
+   file_map_release_blocks(&old_inode);
+   return E_SUCCESS;
+}
+
+/* Moves the inode at inode_num to new_block. Open descriptors, buffered
+contents and the name index know the file by its inode, so they follow
+it. */
+static int defrag_move_inode(blockNumber inode_num, inode_t *inode, blockNumber new_block) {
+   if(cache_write_block(new_block, inode) != E_SUCCESS) {
+      free_run(new_block, 1);
+      return E_WRITE_BLOCK;
+   }
+   for(int i = 0; i < next_fd; i++) {
+      if(resource_table[i].filename != NULL && resource_table[i].inode == inode_num) {
+         resource_table[i].inode = new_block;
+      }
+   }
+   PendingWrite *pending = pending_entry(inode_num);
+   if(pending != NULL) {
+      pending->inode = new_block;
+   }
+   if(name_index_loaded) {
+      NameEntry *entry = name_index_slot(inode->file_name);
+      if(entry->inode == inode_num) {
+         entry->inode = new_block;
+      }
+   }
+   free_run(inode_num, 1);
+   return E_SUCCESS;
+}
+
+/* Relocates fragmented files into contiguous runs of free blocks, and
+compacts free space by moving whole files, inodes included, to where
+that merges free runs, so a later large allocation finds a run long
+enough. Passes carry on a sweep of the files where the last one left
+off, and at most ioBudget block reads and writes are issued in each,
+counting the free list links rewritten, so a caller can run this in the
+background a pass at a time between foreground requests; only the first
+file of a pass may take it over the budget, so every pass makes
+progress. Returns the number of files looked at during this pass, 0 once
+a whole sweep has found nothing left to move, or an error. */
+static int do_defrag(int ioBudget) {
+   // Check if there's a mounted disk
+   if(mounted_disk < 0) {
+      return E_NO_MOUNTED_DISK;
+   }
+   if(ioBudget <= 0) {
+      ioBudget = DEFRAG_IO_BUDGET;
+   }
+
+   blockNumber total_blocks = diskBlocks(mounted_disk);
+   if(total_blocks <= 0) {
+      return E_DEFRAG;
+   }
+   if(free_space_load() != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+
+   // The files are found through the name index, read in here if no file
+   // has been opened yet at the cost of a read of every block in use
+   blockNumber io_used = 0;
+   if(!name_index_loaded) {
+      io_used = total_blocks - 1;
+      for(blockNumber i = 0; i < free_extent_count; i++) {
+         io_used -= free_extents[i].count;
+      }
+      if(name_index_load() != E_SUCCESS) {
+         return E_READ_BLOCK;
+      }
+   }
+
+   int files_seen = 0;
+   int counted = refcount_table(0) >= 0;
+   for(;;) {
+      blockNumber inode_num = defrag_next_inode(defrag_cursor);
+      if(inode_num < 0) {
+         // The end of a sweep: done if it moved nothing, or else start
+         // another, since moves open up room for more
+         int moved = defrag_sweep_moved;
+         defrag_reset();
+         if(!moved) {
+            return 0;
+         }
+         continue;
+      }
+      if(files_seen > 0 && io_used >= ioBudget) {
+         break; // Leave the rest for the next pass
+      }
+
+      inode_t inode;
+      FileMap map;
+      if(cache_read_block(inode_num, &inode) != E_SUCCESS) {
+         return E_READ_BLOCK;
+      }
+      io_used++;
+      if(inode.block_type != INODE_TYPE || inode.magic_number != MAGIC_NUMBER) {
+         defrag_cursor = inode_num + 1;
+         continue;
+      }
+      if(file_map_load(&inode, &map) != E_SUCCESS) {
+         return E_READ_BLOCK;
+      }
+      blockNumber map_blocks = 0;
+      if(disk_format == FORMAT_REVISION && map.count > INODE_EXTENTS) {
+         map_blocks = (map.count - INODE_EXTENTS + MAP_BLOCK_EXTENTS - 1) / MAP_BLOCK_EXTENTS;
+      }
+      io_used += map_blocks;
+
+      // Look at where the data blocks are, and which are shared
+      blockNumber num_blocks = 0;
+      blockNumber data_runs = 0;
+      blockNumber first = -1;
+      int fragmented = 0;
+      int shared = 0;
+      for(blockNumber i = 0, next = -1; i < map.count; i++) {
+         const MapRun *run = &map.runs[i];
+         if(run->start < 0) {
+            continue;
+         }
+         fragmented |= next >= 0 && run->start != next;
+         first = first < 0 ? run->start : first;
+         next = run->start + run->count;
+         num_blocks += run->count;
+         data_runs++;
+         if(counted) {
+            io_used += (next - 1) / REFCOUNTS_PER_BLOCK - run->start / REFCOUNTS_PER_BLOCK + 1;
+         }
+         for(blockNumber b = run->start; counted && !shared && b < next; b++) {
+            shared = block_refs(b) > 0;
+         }
+      }
+
+      // Moving a shared block would strand its other owners. A fragmented
+      // file goes to the first run that holds it; a contiguous one only
+      // moves where that merges free runs.
+      blockNumber target = -1;
+      if(num_blocks > 0 && !shared && fragmented) {
+         for(blockNumber i = 0; i < free_extent_count && target < 0; i++) {
+            target = free_extents[i].count >= num_blocks ? i : -1;
+         }
+      } else if(num_blocks > 0 && !shared) {
+         target = defrag_best_fit(first, num_blocks);
+         if(target >= 0 && defrag_gain(first, num_blocks, target) <= 0) {
+            target = -1;
+         }
+      }
+
+      // Copying costs a read and a write per block and the inode write.
+      // Freeing a block rewrites it as a link; taking or freeing a run
+      // also rewrites the link that leads to it, which may mean reading
+      // the superblock. Map blocks are taken, written and freed alike.
+      blockNumber new_map_blocks = 0;
+      if(disk_format == FORMAT_REVISION && map.count - data_runs + 1 > INODE_EXTENTS) {
+         new_map_blocks = (map.count - data_runs + 1 - INODE_EXTENTS + MAP_BLOCK_EXTENTS - 1) / MAP_BLOCK_EXTENTS;
+      }
+      blockNumber cost = 3 * num_blocks + 2 * data_runs + 3 + 3 * new_map_blocks + 3 * map_blocks;
+      if(target >= 0 && files_seen > 0 && io_used + cost > ioBudget) {
+         file_map_free(&map);
+         break; // Move it at the start of the next pass
+      }
+      int result = E_SUCCESS;
+      if(target >= 0) {
+         blockNumber new_start = free_space_take_run(target, num_blocks);
+         result = new_start < 0 ? E_DISK_FULL
+                : defrag_move_data(inode_num, &inode, &map, new_start, num_blocks);
+         io_used += cost;
+         defrag_sweep_moved = 1;
+      }
+      file_map_free(&map);
+      if(result != E_SUCCESS) {
+         return result;
+      }
+
+      // The inode itself moves on the same terms, for a take, a write and
+      // a free
+      defrag_cursor = inode_num + 1;
+      target = defrag_best_fit(inode_num, 1);
+      if(target >= 0 && defrag_gain(inode_num, 1, target) > 0 &&
+         (io_used + 6 <= ioBudget || files_seen == 0)) {
+         blockNumber new_block = free_space_take_run(target, 1);
+         result = new_block < 0 ? E_DISK_FULL : defrag_move_inode(inode_num, &inode, new_block);
+         if(result != E_SUCCESS) {
+            return result;
+         }
+         io_used += 6;
+         defrag_sweep_moved = 1;
+      }
+      files_seen++;
+   }
+   return files_seen;
+}
+
+
+blockNumber find_file(const char* name) {
+   // Look the name up in the index, building it first if need be
+   // Return the inode if found, -1 if not found
+   if(name_index_load() != E_SUCCESS || name_index_room == 0) {
+      return -1;
+   }
+   NameEntry *entry = name_index_slot(name);
+   return entry->inode > 0 ? entry->inode : -1;
+}
+blockNumber create_file(const char* name) {
+   // Allocate a block for the new inode
+   blockNumber* blocks = allocate_blocks(1);
+   if(blocks == NULL) {
+      return E_CREATE_FILE;
+   }
+   blockNumber inode_num = blocks[0];
+   free(blocks);
+
+   // An empty file has no extents yet
+   inode_t inode;
+   memset(&inode, 0, sizeof(inode));
+   inode.block_type = INODE_TYPE;
+   inode.magic_number = MAGIC_NUMBER;
+   strncpy(inode.file_name, name, sizeof(inode.file_name) - 1);
+   inode.file_size = 0;
+   inode.file_extent = -1;
+   if(cache_write_block(inode_num, &inode) != E_SUCCESS) {
+      freeBlock(inode_num);
+      return E_CREATE_FILE;
+   }
+   if(name_index_loaded && name_index_add(name, inode_num) != E_SUCCESS) {
+      name_index_reset(); // Scan the disk again on the next lookup
+   }
+   return inode_num;
+}
+
+/* Takes a contiguous run of num_blocks blocks off the free list, so they
+can be written and read back in one request. Returns a malloc'd array
+of the block numbers, or NULL if there is no run that long. */
+blockNumber* allocate_blocks(blockNumber num_blocks) {
+   blockNumber run_start = free_space_take(num_blocks);
+   if(run_start < 0) {
+      return NULL;
+   }
+   blockNumber *blocks = malloc(num_blocks * sizeof(blockNumber));
+   if(blocks == NULL) {
+      free_run(run_start, num_blocks);
+      return NULL;
+   }
+   for(blockNumber i = 0; i < num_blocks; i++) {
+      blocks[i] = run_start + i;
+   }
+   return blocks;
+}
+
+/* Drops one reference to every block of the extent chain starting at
+*blocks_start, freeing blocks no other file shares, and leaves the chain
+empty. */
+void remove_blocks(blockNumber* blocks_start) {
+   release_chain(*blocks_start);
+   *blocks_start = -1;
+}
+
+/* Returns a block to the free list. */
+void freeBlock(blockNumber block_number) {
+   free_run(block_number, 1);
+}
+
+/* Writes free list links for count blocks starting at first, each to the
+block after it and the last to last_next, in batched disk requests. */
+static int write_free_links(blockNumber first, blockNumber count, blockNumber last_next) {
+   if(count <= 0) {
+      return E_SUCCESS;
+   }
+   blockNumber batch_blocks = count < WRITE_BATCH_BLOCKS ? count : WRITE_BATCH_BLOCKS;
+   char *batch = malloc(batch_blocks * BLOCKSIZE);
+   if(batch == NULL) {
+      return E_WRITE_BLOCK;
+   }
+   free_block_t free_block;
+   memset(&free_block, 0, sizeof(free_block));
+   free_block.block_type = FREE_BLOCK_TYPE;
+   free_block.magic_number = MAGIC_NUMBER;
+   int result = E_SUCCESS;
+   for(blockNumber done = 0; done < count && result == E_SUCCESS; done += batch_blocks) {
+      blockNumber n = count - done < batch_blocks ? count - done : batch_blocks;
+      for(blockNumber i = 0; i < n; i++) {
+         blockNumber b = first + done + i;
+         free_block.next_free_block = b + 1 < first + count ? b + 1 : last_next;
+         encode_block(&free_block, batch + i * BLOCKSIZE);
+      }
+      result = cache_write_blocks(first + done, n, batch);
+   }
+   free(batch);
+   return result;
+}
+
+/* Works out which blocks of the ascending free run of count blocks at
+start can be discarded: whole host pages, short of the last block, which
+keeps the link out of the run. Sets [*first, *end), empty at start if
+there are none. */
+static void discard_span(blockNumber start, blockNumber count, blockNumber *first, blockNumber *end) {
+   *first = (start + DISCARD_ALIGN_BLOCKS - 1) / DISCARD_ALIGN_BLOCKS * DISCARD_ALIGN_BLOCKS;
+   *end = (start + count - 1) / DISCARD_ALIGN_BLOCKS * DISCARD_ALIGN_BLOCKS;
+   if(disk_format == FORMAT_REVISION_32 || *end <= *first) {
+      *first = start; // Older readers can't follow a discarded block
+      *end = start;
+   }
+}
+
+/* Hands count free blocks starting at first back to the host. Cached
+copies are dropped once the blocks read back as zeros. */
+static int discard_blocks(blockNumber first, blockNumber count) {
+   inflight_wait(first, count);
+   int result = discardBlocks(mounted_disk, first, count);
+   if(result != E_SUCCESS) {
+      return result;
+   }
+   cache_forget(first, count);
+   return E_SUCCESS;
+}
+
+typedef struct DiscardRun {
+   blockNumber start;
+   blockNumber count;
+} DiscardRun;
+
+// Freed runs waiting for a batched discard. Each is linked in ascending
+// order on the free list; allocations cut themselves out of the queue.
+DiscardRun discard_queue[DISCARD_QUEUE_RUNS];
+int discard_queued = 0;
+
+/* Discards every queued run. */
+static void discard_pending(void) {
+   for(int i = 0; i < discard_queued; i++) {
+      blockNumber first, end;
+      discard_span(discard_queue[i].start, discard_queue[i].count, &first, &end);
+      if(end > first) {
+         discard_blocks(first, end - first);
+      }
+   }
+   discard_queued = 0;
+}
+
+/* Drops count blocks starting at start from the discard queue because
+they are no longer free, splitting runs that only partly overlap. */
+static void discard_forget(blockNumber start, blockNumber count) {
+   blockNumber end = start + count;
+   for(int i = discard_queued - 1; i >= 0; i--) {
+      DiscardRun run = discard_queue[i];
+      blockNumber run_end = run.start + run.count;
+      if(run_end <= start || run.start >= end) {
+         continue;
+      }
+      discard_queue[i] = discard_queue[--discard_queued];
+      if(run.start < start) {
+         discard_queue[discard_queued].start = run.start;
+         discard_queue[discard_queued++].count = start - run.start;
+      }
+      if(run_end > end && discard_queued < DISCARD_QUEUE_RUNS) {
+         discard_queue[discard_queued].start = end;
+         discard_queue[discard_queued++].count = run_end - end;
+      }
+   }
+}
+
+/* Returns count blocks starting at start to the free list, linked in
+ascending order between the free runs on either side, so the middle of
+the run can be discarded and read back as links to the next block. */
+static void free_run(blockNumber start, blockNumber count) {
+   if(count <= 0 || free_space_load() != E_SUCCESS) {
+      return;
+   }
+   blockNumber i = free_space_after(start);
+   blockNumber next = i < free_extent_count ? free_extents[i].start : -1;
+   blockNumber first = start, end = start;
+   if(discard_mode == DISCARD_INLINE) {
+      discard_span(start, count, &first, &end);
+      if(end > first && discard_blocks(first, end - first) != E_SUCCESS) {
+         end = first; // Not discarded after all, so it needs its links
+      }
+   }
+   if(write_free_links(start, first - start, first) != E_SUCCESS ||
+      write_free_links(end, start + count - end, next) != E_SUCCESS ||
+      free_space_link(i, start) != E_SUCCESS) {
+      free_extents_loaded = 0; // Read the list again rather than trust this
+      return;
+   }
+
+   // Merge with the runs on either side
+   int before = i > 0 && free_extents[i - 1].start + free_extents[i - 1].count == start;
+   int after = i < free_extent_count && start + count == free_extents[i].start;
+   if(before && after) {
+      free_extents[i - 1].count += count + free_extents[i].count;
+      free_space_remove(i);
+   } else if(before) {
+      free_extents[i - 1].count += count;
+   } else if(after) {
+      free_extents[i].start = start;
+      free_extents[i].count += count;
+   } else if(free_space_insert(i, start, count) != E_SUCCESS) {
+      free_extents_loaded = 0;
+   }
+
+   if(discard_mode == DISCARD_BATCHED) {
+      if(discard_queued == DISCARD_QUEUE_RUNS) {
+         discard_pending();
+      }
+      discard_queue[discard_queued].start = start;
+      discard_queue[discard_queued++].count = count;
+   }
+}
+
+/* Drops one reference to every block of the extent chain starting at
+first_block. Blocks no other file shares go back to the free list a
+contiguous run at a time. Revision 3 data blocks don't link to each
+other, so there the chain is first_block alone. */
+static int release_chain(blockNumber first_block) {
+   blockNumber run_start = -1;
+   blockNumber run_count = 0;
+   blockNumber current_block = first_block;
+   file_extent_t extent;
+   int result = E_SUCCESS;
+   while(current_block != -1) {
+      if(cache_read_block(current_block, &extent) != E_SUCCESS) {
+         result = E_READ_BLOCK;
+         break;
+      }
+      if(block_refs(current_block) > 0) {
+         add_block_refs(current_block, 1, -1);
+      } else if(run_count > 0 && current_block == run_start + run_count) {
+         run_count++;
+      } else {
+         if(run_count > 0) {
+            free_run(run_start, run_count);
+         }
+         run_start = current_block;
+         run_count = 1;
+      }
+      current_block = disk_format == FORMAT_REVISION ? -1 : extent_next(&extent);
+   }
+   if(run_count > 0) {
+      free_run(run_start, run_count);
+   }
+   return result;
+}
+
+/* Chooses when freed blocks are handed back to the host: DISCARD_OFF,
+DISCARD_INLINE as each run is freed, or DISCARD_BATCHED by the flusher,
+tfs_sync and tfs_unmount. Returns success/error codes. */
+static int do_discard(int mode) {
+   if(mode != DISCARD_OFF && mode != DISCARD_INLINE && mode != DISCARD_BATCHED) {
+      return E_DISCARD;
+   }
+   if(mode != DISCARD_BATCHED && mounted_disk >= 0) {
+      discard_pending();
+   }
+   discard_mode = mode;
+   return E_SUCCESS;
+}
+
+/* Sweeps the whole free list, handing every free run back to the host,
+including blocks freed before discard was on. Returns the number of blocks
+discarded, or an error. */
+static int do_trim(void) {
+   if(mounted_disk < 0) {
+      return E_NO_MOUNTED_DISK;
+   }
+   if(disk_format == FORMAT_REVISION_32) {
+      return E_DISCARD; // Older readers can't follow a discarded block
+   }
+   if(free_space_load() != E_SUCCESS) {
+      return E_READ_BLOCK;
+   }
+
+   // The list is in block order, so all but the last block of each run
+   // can go; the rest read back as links to the block after them
+   blockNumber discarded = 0;
+   for(blockNumber i = 0; i < free_extent_count; i++) {
+      blockNumber first, end;
+      discard_span(free_extents[i].start, free_extents[i].count, &first, &end);
+      if(end > first && discard_blocks(first, end - first) == E_SUCCESS) {
+         discarded += end - first;
+      }
+   }
+   discard_queued = 0;
+   return discarded > INT_MAX ? INT_MAX : (int)discarded;
+}
+
+
+/* Waits for the flusher's writes in flight to land, then finishes the
+file flushes among them. Called with fs_lock held; the flusher does not
+need it to finish writing. */
+static void flusher_drain(void) {
+   pthread_mutex_lock(&inflight_lock);
+   while(inflight_count > 0) {
+      pthread_cond_wait(&inflight_done, &inflight_lock);
+   }
+   int result = inflight_result;
+   inflight_result = E_SUCCESS;
+   pthread_mutex_unlock(&inflight_lock);
+
+   if(result != E_SUCCESS && writeback_error == E_SUCCESS) {
+      writeback_error = result;
+   }
+   for(int i = 0; i < flush_job_count; i++) {
+      flush_commit(&flush_jobs[i], result);
+      free(flush_jobs[i].blocks);
+   }
+   flush_job_count = 0;
+}
+
+/* Copies what the flusher is due to write: the contents of files buffered
+before cutoff, and the dirty blocks of the cache, which are marked clean.
+The copies are listed as in flight in *runs, backed by *copy and the
+jobs' own blocks. Returns the number of runs. */
+static int flusher_snapshot(long long cutoff, long long block_cutoff, InflightRun **runs, char **copy) {
+   *runs = malloc((CACHE_BLOCKS + MAX_OPEN_FILES) * sizeof(InflightRun));
+   *copy = malloc(CACHE_BLOCKS * BLOCKSIZE);
+   if(*runs == NULL || *copy == NULL) {
+      free(*runs);
+      free(*copy);
+      return 0;
+   }
+   int count = 0;
+
+   // File contents go first: their blocks leave the free list here, and
+   // any dirty free list links cached for them are dropped before the
+   // cache is copied
+   for(int i = 0; i < MAX_OPEN_FILES; i++) {
+      PendingWrite *pending = &pending_writes[i];
+      if(pending->data == NULL || pending->flushing || pending->since > cutoff) {
+         continue;
+      }
+      FlushJob *job = &flush_jobs[flush_job_count];
+      if(flush_prepare(pending, job) != E_SUCCESS) {
+         continue; // Tried again next time
+      }
+      if(job->fresh_count == 0) {
+         flush_commit(job, E_SUCCESS); // Nothing to write
+         continue;
+      }
+      job->blocks = malloc(job->fresh_count * BLOCKSIZE);
+      if(job->blocks == NULL) {
+         flush_commit(job, E_WRITE_FILE);
+         continue;
+      }
+      flush_build(job, job->fresh_count, job->blocks);
+      (*runs)[count].start = job->fresh_start;
+      (*runs)[count].count = job->fresh_count;
+      (*runs)[count++].data = job->blocks;
+      pending->flushing = 1;
+      flush_job_count++;
+   }
+
+   int order[CACHE_BLOCKS];
+   int dirty = cache_dirty_slots(block_cutoff, order);
+   for(int i = 0; i < dirty; ) {
+      blockNumber first = block_cache[order[i]].block;
+      int n = 0;
+      char *data = *copy + i * BLOCKSIZE;
+      while(i + n < dirty && block_cache[order[i + n]].block == first + n) {
+         memcpy(data + n * BLOCKSIZE, block_cache[order[i + n]].buf->data, BLOCKSIZE);
+         block_cache[order[i + n]].dirty = 0;
+         n++;
+      }
+      (*runs)[count].start = first;
+      (*runs)[count].count = n;
+      (*runs)[count++].data = data;
+      i += n;
+   }
+
+   if(count == 0) {
+      free(*runs);
+      free(*copy);
+      return 0;
+   }
+   pthread_mutex_lock(&inflight_lock);
+   inflight_runs = *runs;
+   inflight_count = count;
+   pthread_mutex_unlock(&inflight_lock);
+   return count;
+}
+
+/* Background flusher: writes back blocks and buffered files once they
+have been dirty for writeback_age_ms, or everything once more than
+writeback_dirty_ratio percent of the cache is dirty. What is due is copied
+under fs_lock and written without it, so tfs_* calls go on meanwhile. */
+static void *flusher_main(void *arg) {
+   int generation = *(int *)arg;
+   free(arg);
+   for(;;) {
+      long long interval = writeback_age_ms * 1000000LL / 2;
+      struct timespec delay;
+      delay.tv_sec = interval / 1000000000LL;
+      delay.tv_nsec = interval % 1000000000LL;
+      nanosleep(&delay, NULL);
+
+      pthread_mutex_lock(&fs_lock);
+      if(generation != flusher_generation) {
+         pthread_mutex_unlock(&fs_lock);
+         return NULL; // Stopped or replaced by tfs_writeback
+      }
+      InflightRun *runs = NULL;
+      char *copy = NULL;
+      int count = 0;
+      int disk = mounted_disk;
+      if(mounted_disk >= 0) {
+         // A batch left by a flusher this one replaced is finished first,
+         // and queued discards go out before blocks are copied, since
+         // they would have to wait for them
+         flusher_drain();
+         discard_pending();
+         dedup_writeback();
+         long long cutoff = clock_ns() - writeback_age_ms * 1000000LL;
+         int dirty = 0;
+         for(int i = 0; i < CACHE_BLOCKS; i++) {
+            dirty += block_cache[i].dirty;
+         }
+         long long block_cutoff = dirty * 100 > writeback_dirty_ratio * CACHE_BLOCKS ? 0 : cutoff;
+         count = flusher_snapshot(cutoff, block_cutoff, &runs, &copy);
+      }
+      pthread_mutex_unlock(&fs_lock);
+      if(count == 0) {
+         continue;
+      }
+
+      int result = E_SUCCESS;
+      for(int i = 0; i < count; i++) {
+         int written = writeBlocks(disk, runs[i].start, runs[i].count, runs[i].data);
+         if(written != E_SUCCESS) {
+            result = written;
+         }
+      }
+      pthread_mutex_lock(&inflight_lock);
+      inflight_runs = NULL;
+      inflight_count = 0;
+      inflight_result = result;
+      pthread_cond_broadcast(&inflight_done);
+      pthread_mutex_unlock(&inflight_lock);
+      free(runs);
+      free(copy);
+
+      pthread_mutex_lock(&fs_lock);
+      flusher_drain();
+      pthread_mutex_unlock(&fs_lock);
+   }
+}
+
+/* Turns on write-back caching with a background flusher, or with ageMs of
+0 turns it off again after writing everything back. dirtyRatio is the
+percentage of the cache allowed to be dirty before the flusher writes all
+of it. Metadata, free list links and short data runs then wait in the
+cache; only runs longer than WRITEBACK_RUN_BLOCKS are written under
+fs_lock by the call that makes them. Returns success/error codes. */
+static int do_writeback(int ageMs, int dirtyRatio) {
+   if(ageMs < 0 || dirtyRatio < 0 || dirtyRatio > 100) {
+      return E_WRITEBACK;
+   }
+
+   // Any running flusher exits when it next wakes up
+   flusher_generation++;
+   if(ageMs == 0) {
+      writeback_enabled = 0;
+      if(mounted_disk >= 0) {
+         flusher_drain();
+         flush_all();
+         cache_writeback(0);
+      }
+      return E_SUCCESS;
+   }
+
+   writeback_age_ms = ageMs;
+   writeback_dirty_ratio = dirtyRatio;
+   int *generation = malloc(sizeof(int));
+   if(generation == NULL) {
+      return E_WRITEBACK;
+   }
+   *generation = flusher_generation;
+   pthread_t flusher;
+   if(pthread_create(&flusher, NULL, flusher_main, generation) != 0) {
+      free(generation);
+      return E_WRITEBACK;
+   }
+   pthread_detach(flusher);
+   writeback_enabled = 1;
+   return E_SUCCESS;
+}
+
+/* Writes every buffered file and dirty block of the mounted file system
+to the disk and waits until the disk reports them stored. Returns the
+first write-back error since the last sync, if any. */
+static int do_sync(void) {
+   if(mounted_disk < 0) {
+      return E_NO_MOUNTED_DISK;
+   }
+   flusher_drain();
+   int result = flush_all();
+   discard_pending();
+   dedup_writeback();
+   cache_writeback(0);
+   if(result == E_SUCCESS) {
+      result = writeback_error;
+   }
+   writeback_error = E_SUCCESS;
+   int synced = syncDisk(mounted_disk);
+   return result != E_SUCCESS ? result : synced;
+}
+
+/* Makes one file durable: writes its buffered contents, then the dirty
+blocks, which include the inode and free-list changes it depends on, and
+waits for the disk. */
+static int do_fsync(fileDescriptor FD) {
+   if(!fd_open(FD)) {
+      return E_WRITE_FILE; // Invalid file descriptor
+   }
+   int result = do_flush(FD);
+   flusher_drain();
+   cache_writeback(0);
+   if(result == E_SUCCESS) {
+      result = writeback_error;
+   }
+   writeback_error = E_SUCCESS;
+   int synced = syncDisk(mounted_disk);
+   return result != E_SUCCESS ? result : synced;
+}
+
+// Trace output, NULL while tracing is off
+FILE *trace_file = NULL;
+long long trace_origin = 0;
+int trace_depth = 0;
+int trace_env_checked = 0;
+
+/* Starts recording every tfs_* call to the binary trace file filename,
+replacing any trace already being written. Tracing also starts on the
+first call when the TINYFS_TRACE environment variable names a file. */
+int tfs_traceStart(char *filename) {
+   tfs_traceStop();
+   trace_file = fopen(filename, "wb");
+   if(trace_file == NULL) {
+      return E_TRACE;
+   }
+   tfs_trace_header_t header = { TRACE_MAGIC, TRACE_VERSION, 0 };
+   if(mounted_disk >= 0) {
+      header.disk_size = diskBlocks(mounted_disk) * BLOCKSIZE;
+   }
+   if(fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+      fclose(trace_file);
+      trace_file = NULL;
+      return E_TRACE;
+   }
+   trace_origin = clock_ns();
+   return E_SUCCESS;
+}
+
+/* Stops tracing and closes the trace file. */
+int tfs_traceStop(void) {
+   if(trace_file == NULL) {
+      return E_SUCCESS;
+   }
+   int result = fclose(trace_file) == 0 ? E_SUCCESS : E_TRACE;
+   trace_file = NULL;
+   return result;
+}
+
+/* Starts a call: takes the file system lock, which the background flusher
+also holds while it picks what to write, and starts timing. Calls made from inside
+another tfs_* call are not recorded, so a replay doesn't run them twice. */
+static long long call_begin(void) {
+   pthread_once(&fs_lock_once, init_fs_lock);
+   pthread_mutex_lock(&fs_lock);
+   if(!trace_env_checked) {
+      trace_env_checked = 1;
+      char *path = getenv("TINYFS_TRACE");
+      if(path != NULL && trace_file == NULL) {
+         tfs_traceStart(path);
+      }
+   }
+   trace_depth++;
+   return trace_file != NULL && trace_depth == 1 ? clock_ns() : 0;
+}
+
+/* Records a finished call, releases the lock and passes its result
+through. */
+static int call_end(int op, int fd, const char *name, byteCount size, byteCount offset, int result, long long start) {
+   trace_depth--;
+   if(trace_file == NULL || trace_depth != 0 || start == 0) {
+      pthread_mutex_unlock(&fs_lock);
+      return result;
+   }
+   tfs_trace_record_t record;
+   memset(&record, 0, sizeof(record));
+   record.op = op;
+   record.fd = fd;
+   record.size = size;
+   record.offset = offset;
+   record.result = result;
+   record.start_ns = start - trace_origin;
+   record.duration_ns = clock_ns() - start;
+   if(name != NULL) {
+      strncpy(record.name, name, sizeof(record.name) - 1);
+   }
+   fwrite(&record, sizeof(record), 1, trace_file);
+   pthread_mutex_unlock(&fs_lock);
+   return result;
+}
+
+/* Public entry points: each runs the call above and traces it. */
+
+int tfs_mkfs(char *filename, byteCount nBytes) {
+   long long start = call_begin();
+   return call_end(TRACE_MKFS, -1, filename, nBytes, 0, do_mkfs(filename, nBytes), start);
+}
+
+int tfs_mount(char *diskname) {
+   long long start = call_begin();
+   int result = do_mount(diskname);
+   // The mount records the disk size so a replay can make a disk like it
+   byteCount size = result >= 0 ? diskBlocks(mounted_disk) * BLOCKSIZE : 0;
+   return call_end(TRACE_MOUNT, -1, diskname, size, 0, result, start);
+}
+
+int tfs_unmount(void) {
+   long long start = call_begin();
+   return call_end(TRACE_UNMOUNT, -1, NULL, 0, 0, do_unmount(), start);
+}
+
+fileDescriptor tfs_openFile(char *name) {
+   long long start = call_begin();
+   return call_end(TRACE_OPEN, -1, name, 0, 0, do_openFile(name), start);
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+   long long start = call_begin();
+   return call_end(TRACE_CLOSE, FD, NULL, 0, 0, do_closeFile(FD), start);
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, byteCount size) {
+   long long start = call_begin();
+   return call_end(TRACE_WRITE, FD, NULL, size, 0, do_writeFile(FD, buffer, size), start);
+}
+
+int tfs_flush(fileDescriptor FD) {
+   long long start = call_begin();
+   return call_end(TRACE_FLUSH, FD, NULL, 0, 0, do_flush(FD), start);
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+   long long start = call_begin();
+   return call_end(TRACE_DELETE, FD, NULL, 0, 0, do_deleteFile(FD), start);
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+   long long start = call_begin();
+   return call_end(TRACE_READBYTE, FD, NULL, 1, 0, do_readByte(FD, buffer), start);
+}
+
+int tfs_seek(fileDescriptor FD, byteCount offset) {
+   long long start = call_begin();
+   return call_end(TRACE_SEEK, FD, NULL, 0, offset, do_seek(FD, offset), start);
+}
+
+int tfs_defrag(int ioBudget) {
+   long long start = call_begin();
+   return call_end(TRACE_DEFRAG, -1, NULL, ioBudget, 0, do_defrag(ioBudget), start);
+}
+
+int tfs_readAhead(int maxBlocks) {
+   long long start = call_begin();
+   return call_end(TRACE_READAHEAD, -1, NULL, maxBlocks, 0, do_readAhead(maxBlocks), start);
+}
+
+fileDescriptor tfs_cloneFile(fileDescriptor srcFD, char *newName) {
+   long long start = call_begin();
+   return call_end(TRACE_CLONE, srcFD, newName, 0, 0, do_cloneFile(srcFD, newName), start);
+}
+
+int tfs_writeback(int ageMs, int dirtyRatio) {
+   long long start = call_begin();
+   return call_end(TRACE_WRITEBACK, -1, NULL, ageMs, dirtyRatio, do_writeback(ageMs, dirtyRatio), start);
+}
+
+int tfs_sync(void) {
+   long long start = call_begin();
+   return call_end(TRACE_SYNC, -1, NULL, 0, 0, do_sync(), start);
+}
+
+int tfs_fsync(fileDescriptor FD) {
+   long long start = call_begin();
+   return call_end(TRACE_FSYNC, FD, NULL, 0, 0, do_fsync(FD), start);
+}
+
+int tfs_discard(int mode) {
+   long long start = call_begin();
+   return call_end(TRACE_DISCARD, -1, NULL, mode, 0, do_discard(mode), start);
+}
+
+int tfs_trim(void) {
+   long long start = call_begin();
+   return call_end(TRACE_TRIM, -1, NULL, 0, 0, do_trim(), start);
+}
+
+int tfs_dedup(int enabled) {
+   long long start = call_begin();
+   return call_end(TRACE_DEDUP, -1, NULL, enabled, 0, do_dedup(enabled), start);
+}
+
+int tfs_dedupStats(tfs_dedup_stats_t *stats) {
+   long long start = call_begin();
+   return call_end(TRACE_DEDUP_STATS, -1, NULL, 0, 0, do_dedupStats(stats), start);
+}
+
+int tfs_stripeUnit(int blocks) {
+   long long start = call_begin();
+   return call_end(TRACE_STRIPE, -1, NULL, blocks, 0, do_stripeUnit(blocks), start);
+}
+
+int tfs_sparseWrites(int enabled) {
+   long long start = call_begin();
+   return call_end(TRACE_SPARSE, -1, NULL, enabled, 0, do_sparseWrites(enabled), start);
+}
+
+int tfs_mapFile(fileDescriptor FD, tfs_iovec_t **iov, int *count) {
+   long long start = call_begin();
+   return call_end(TRACE_MAP, FD, NULL, 0, 0, do_mapFile(FD, iov, count), start);
+}
+
+int tfs_unmapFile(int handle) {
+   long long start = call_begin();
+   return call_end(TRACE_UNMAP, -1, NULL, 0, handle, do_unmapFile(handle), start);
+}
+
+int tfs_readv(fileDescriptor FD, tfs_iovec_t *iov, int iovcnt) {
+   // A NULL vector or negative count is left for do_readv to reject
+   byteCount size = 0;
+   for(int i = 0; iov != NULL && i < iovcnt; i++) {
+      size += iov[i].len;
+   }
+   long long start = call_begin();
+   return call_end(TRACE_READV, FD, NULL, size, iovcnt, do_readv(FD, iov, iovcnt), start);
+}
@@ -0,0 +1,252 @@
+/* TinyFS benchmarks
+ * Usage: tfsBench readahead [fileBlocks] [passes]
+ *        tfsBench stripe [maxMembers] [diskBlocks] [requestBlocks]
+ *        tfsBench dedup [files] [fileBlocks] [dupPercent]
+ * readahead: sequential tfs_readByte scan throughput with read-ahead off
+ * and on over one freshly written (and so contiguous) file.
+ * stripe: large writeBlocks/readBlocks throughput on striped volumes of
+ * 1 to maxMembers image files. Extra members only add throughput when the
+ * images sit on separate devices and there is a CPU to drive each one.
+ * dedup: time to write files of which dupPercent are near copies of one
+ * template, differing in a header in their first block, with tfs_dedup
+ * off and on, and the dedup hit rate. */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tinyFS.h"
+#include "libDisk.h"
+
+#define BENCH_DISK_NAME "tfsBench.dsk"
+
+static double
+now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mount a fresh disk holding one file "bench" of fileBlocks blocks */
+static fileDescriptor
+buildImage (int fileBlocks)
+{
+   int size = fileBlocks * EXTENT_DATA_SIZE;
+   char *content;
+   fileDescriptor FD;
+   int i;
+
+   if (tfs_mkfs (BENCH_DISK_NAME, (fileBlocks + 2) * BLOCKSIZE) < 0)
+      return -1;
+   if (tfs_mount (BENCH_DISK_NAME) < 0)
+      return -1;
+   FD = tfs_openFile ("bench");
+   if (FD < 0)
+      return -1;
+
+   content = malloc (size);
+   for (i = 0; i < size; i++)
+      content[i] = 'a' + i % 26;
+   if (tfs_writeFile (FD, content, size) < 0 || tfs_flush (FD) < 0)
+      FD = -1;
+   free (content);
+   return FD;
+}
+
+/* returns MB/s for passes full sequential scans of FD */
+static double
+scan (fileDescriptor FD, int passes)
+{
+   char c;
+   long bytes = 0;
+   double start = now ();
+   int p;
+
+   for (p = 0; p < passes; p++)
+   {
+      tfs_seek (FD, 0);
+      while (tfs_readByte (FD, &c) >= 0)
+         bytes++;
+   }
+   return bytes / (now () - start) / (1024.0 * 1024.0);
+}
+
+static int
+benchReadAhead (int fileBlocks, int passes)
+{
+   fileDescriptor FD = buildImage (fileBlocks);
+
+   if (FD < 0)
+   {
+      fprintf (stderr, "failed to build benchmark disk\n");
+      return 1;
+   }
+
+   tfs_readAhead (0);
+   printf ("read-ahead off: %8.2f MB/s\n", scan (FD, passes));
+   tfs_readAhead (READ_AHEAD_MAX);
+   printf ("read-ahead on:  %8.2f MB/s\n", scan (FD, passes));
+
+   tfs_closeFile (FD);
+   tfs_unmount ();
+   remove (BENCH_DISK_NAME);
+   return 0;
+}
+
+/* MB/s moving a whole volume in requests of requestBlocks blocks */
+static double
+transfer (int disk, int diskBlocks, int requestBlocks, char *buffer, int write)
+{
+   double start = now ();
+   int b, count;
+
+   for (b = 0; b + requestBlocks <= diskBlocks; b += requestBlocks)
+   {
+      count = requestBlocks;
+      if ((write ? writeBlocks (disk, b, count, buffer)
+           : readBlocks (disk, b, count, buffer)) < 0)
+         return -1;
+   }
+   return (double) b * BLOCKSIZE / (now () - start) / (1024.0 * 1024.0);
+}
+
+static int
+benchStripe (int maxMembers, int diskBlocks, int requestBlocks)
+{
+   char names[256], member[32];
+   char *buffer = malloc ((size_t) requestBlocks * BLOCKSIZE);
+   int members, i, disk;
+
+   memset (buffer, 's', (size_t) requestBlocks * BLOCKSIZE);
+   printf ("%7s %12s %12s\n", "members", "write MB/s", "read MB/s");
+   for (members = 1; members <= maxMembers; members++)
+   {
+      names[0] = '\0';
+      for (i = 0; i < members; i++)
+      {
+         sprintf (member, "%stfsBench%d.dsk", i > 0 ? "," : "", i);
+         strcat (names, member);
+      }
+      /* a one-member "volume" needs a trailing separator to be striped */
+      if (members == 1)
+         strcat (names, ",");
+      disk = openDisk (names, diskBlocks * BLOCKSIZE);
+      if (disk < 0)
+      {
+         fprintf (stderr, "failed to create %s\n", names);
+         return 1;
+      }
+      setStripeUnit (disk, DEFAULT_STRIPE_UNIT);
+      printf ("%7d %12.2f", members,
+              transfer (disk, diskBlocks, requestBlocks, buffer, 1));
+      printf (" %12.2f\n", transfer (disk, diskBlocks, requestBlocks, buffer, 0));
+      closeDisk (disk);
+   }
+   for (i = 0; i < maxMembers; i++)
+   {
+      sprintf (member, "tfsBench%d.dsk", i);
+      remove (member);
+   }
+   free (buffer);
+   return 0;
+}
+
+/* seconds to write files, each flushed; every file whose number falls in
+ * the first dupPercent of each hundred is the template with its own
+ * header, the rest have contents of their own throughout */
+static double
+writeFiles (int files, int size, int dupPercent, const char *template)
+{
+   char *content = malloc (size);
+   double start = now ();
+   char name[16];
+   fileDescriptor FD;
+   unsigned seed;
+   int i, j;
+
+   for (i = 0; i < files; i++)
+   {
+      if (i % 100 >= dupPercent)
+      {
+         seed = i * 2654435761u + 1;
+         for (j = 0; j < size; j++)
+         {
+            seed = seed * 1103515245 + 12345;
+            content[j] = 'a' + (seed >> 16) % 26;
+         }
+      }
+      else
+         memcpy (content, template, size);
+      snprintf (content, size, "file %d", i);
+      sprintf (name, "f%d", i);
+      FD = tfs_openFile (name);
+      if (FD < 0 || tfs_writeFile (FD, content, size) < 0 || tfs_flush (FD) < 0)
+      {
+         free (content);
+         return -1;
+      }
+      tfs_closeFile (FD);
+   }
+   free (content);
+   return now () - start;
+}
+
+static int
+benchDedup (int files, int fileBlocks, int dupPercent)
+{
+   int size = fileBlocks * EXTENT_DATA_SIZE;
+   char *content = malloc (size);
+   tfs_dedup_stats_t stats;
+   int enabled, i;
+
+   for (i = 0; i < size; i++)
+      content[i] = 'a' + i % 26;
+   printf ("%5s %10s %10s\n", "dedup", "seconds", "hit rate");
+   for (enabled = 0; enabled <= 1; enabled++)
+   {
+      /* room for every file written out in full, plus the dedup index */
+      if (tfs_mkfs (BENCH_DISK_NAME, ((long long) files * (fileBlocks + 1) * 2 + 16) * BLOCKSIZE) < 0
+          || tfs_mount (BENCH_DISK_NAME) < 0)
+      {
+         fprintf (stderr, "failed to build benchmark disk\n");
+         return 1;
+      }
+      tfs_dedup (enabled);
+      printf ("%5s %10.3f", enabled ? "on" : "off",
+              writeFiles (files, size, dupPercent, content));
+      tfs_dedupStats (&stats);
+      printf (" %9.1f%%\n", stats.blocks > 0
+              ? 100.0 * stats.blocks_shared / stats.blocks : 0.0);
+      tfs_dedup (0);
+      tfs_unmount ();
+   }
+   remove (BENCH_DISK_NAME);
+   free (content);
+   return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+   if (argc >= 2 && strcmp (argv[1], "readahead") == 0)
+      return benchReadAhead (argc > 2 ? atoi (argv[2]) : 4096,
+                             argc > 3 ? atoi (argv[3]) : 5);
+
+   if (argc >= 2 && strcmp (argv[1], "stripe") == 0)
+      return benchStripe (argc > 2 ? atoi (argv[2]) : 4,
+                          argc > 3 ? atoi (argv[3]) : 65536,
+                          argc > 4 ? atoi (argv[4]) : 1024);
+
+   if (argc >= 2 && strcmp (argv[1], "dedup") == 0)
+      return benchDedup (argc > 2 ? atoi (argv[2]) : 200,
+                         argc > 3 ? atoi (argv[3]) : 16,
+                         argc > 4 ? atoi (argv[4]) : 50);
+
+   fprintf (stderr, "usage: %s readahead [fileBlocks] [passes]\n"
+            "       %s stripe [maxMembers] [diskBlocks] [requestBlocks]\n"
+            "       %s dedup [files] [fileBlocks] [dupPercent]\n",
+            argv[0], argv[0], argv[0]);
+   return 1;
+}
@@ -0,0 +1,64 @@
+/* TinyFS defragmenter
+ * Usage: tfsDefrag <diskname> [ioBudget] [delayMs]
+ * Runs tfs_defrag() a pass at a time, sleeping delayMs between passes so
+ * the defragmenter can share the disk with foreground work, until a whole
+ * sweep of the files finds nothing left to move, then hands the free
+ * space back to the host with tfs_trim(). */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "tinyFS.h"
+
+int
+main (int argc, char *argv[])
+{
+   int ioBudget = DEFRAG_IO_BUDGET;
+   int delayMs = 0;
+   int seen, passes = 0;
+   int trimmed;
+   struct timespec delay;
+
+   if (argc < 2)
+   {
+      fprintf (stderr, "usage: %s <diskname> [ioBudget] [delayMs]\n", argv[0]);
+      return 1;
+   }
+   if (argc > 2)
+      ioBudget = atoi (argv[2]);
+   if (argc > 3)
+      delayMs = atoi (argv[3]);
+
+   if (tfs_mount (argv[1]) < 0)
+   {
+      fprintf (stderr, "failed to mount %s\n", argv[1]);
+      return 1;
+   }
+
+   delay.tv_sec = delayMs / 1000;
+   delay.tv_nsec = (delayMs % 1000) * 1000000L;
+
+   /* keep making passes until one reports the sweep is done */
+   while ((seen = tfs_defrag (ioBudget)) > 0)
+   {
+      passes++;
+      if (delayMs > 0)
+         nanosleep (&delay, NULL);
+   }
+   if (seen < 0)
+   {
+      fprintf (stderr, "tfs_defrag failed (%d)\n", seen);
+      tfs_unmount ();
+      return 1;
+   }
+
+   printf ("defragmented in %d pass(es)\n", passes);
+
+   /* older format revisions can't be trimmed; that isn't an error here */
+   trimmed = tfs_trim ();
+   if (trimmed >= 0)
+      printf ("discarded %d free block(s)\n", trimmed);
+   tfs_unmount ();
+   return 0;
+}
@@ -0,0 +1,403 @@
+/* TinyFS image builder
+ * Usage: tfsMkimage <diskname> <directory> [nBytes] [threads]
+ * Builds a TinyFS disk holding every regular file in directory without
+ * going through tfs_writeFile. The whole layout is planned up front: the
+ * inodes sit together right after the superblock, each file gets one
+ * contiguous run of data blocks, which its inode maps as a single extent,
+ * and the rest of the disk is a single free run. Reader threads load and encode files in parallel while the main
+ * thread writes the image front to back in WRITE_BATCH_BLOCKS requests.
+ * Without nBytes the disk is made just big enough. The result mounts
+ * with tfs_mount like any disk made by tfs_mkfs. */
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "tinyFS.h"
+#include "libDisk.h"
+#include "TinyFS_errno.h"
+
+#define MAX_READERS 16
+#define CHUNKS_PER_READER 2 /* encoded chunks each reader may run ahead */
+
+typedef struct ImportFile
+{
+   char name[9];
+   char *path;
+   long long size;
+   long long blocks;  /* data blocks */
+   long long inode;   /* disk block of the inode */
+   long long extent;  /* disk block of the first data block, -1 if empty */
+} ImportFile;
+
+/* up to WRITE_BATCH_BLOCKS consecutive data blocks of one file */
+typedef struct Chunk
+{
+   int file;
+   long long first;   /* first data block of the file in this chunk */
+   long long count;
+   char *blocks;      /* encoded blocks, NULL until a reader is done */
+   int error;
+} Chunk;
+
+static ImportFile *files;
+static int numFiles;
+static Chunk *chunks;
+static long long numChunks;
+static long long nextChunk;     /* next chunk a reader will claim */
+static long long chunksWritten; /* chunks the writer is done with */
+static long long window;        /* chunks allowed in memory at once */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress = PTHREAD_COND_INITIALIZER;
+
+static double
+now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+byName (const void *a, const void *b)
+{
+   return strcmp (((const ImportFile *) a)->name,
+                  ((const ImportFile *) b)->name);
+}
+
+/* collects the regular files of dir, sorted by name so images are
+ * reproducible; names TinyFS can't hold are skipped */
+static int
+scanDirectory (const char *dir)
+{
+   DIR *d = opendir (dir);
+   struct dirent *entry;
+   struct stat st;
+   int capacity = 0;
+
+   if (d == NULL)
+      return -1;
+   while ((entry = readdir (d)) != NULL)
+   {
+      char *path = malloc (strlen (dir) + strlen (entry->d_name) + 2);
+      sprintf (path, "%s/%s", dir, entry->d_name);
+      if (stat (path, &st) != 0 || !S_ISREG (st.st_mode))
+      {
+         free (path);
+         continue;
+      }
+      if (strlen (entry->d_name) > 8)
+      {
+         fprintf (stderr, "skipping %s: names are at most 8 characters\n",
+                  entry->d_name);
+         free (path);
+         continue;
+      }
+      if (numFiles == capacity)
+      {
+         capacity = capacity ? capacity * 2 : 64;
+         files = realloc (files, capacity * sizeof (ImportFile));
+      }
+      strcpy (files[numFiles].name, entry->d_name);
+      files[numFiles].path = path;
+      files[numFiles].size = st.st_size;
+      files[numFiles].blocks = (st.st_size + EXTENT_DATA_SIZE - 1) / EXTENT_DATA_SIZE;
+      numFiles++;
+   }
+   closedir (d);
+   if (numFiles > 0)
+      qsort (files, numFiles, sizeof (ImportFile), byName);
+   return 0;
+}
+
+/* places the inodes after the superblock and the files' data blocks
+ * after them; returns the number of blocks in use and splits the data
+ * blocks into chunks */
+static long long
+planLayout (void)
+{
+   long long next = 1 + numFiles;
+   long long c = 0;
+   long long b;
+   int i;
+
+   numChunks = 0;
+   for (i = 0; i < numFiles; i++)
+      numChunks += (files[i].blocks + WRITE_BATCH_BLOCKS - 1) / WRITE_BATCH_BLOCKS;
+   chunks = calloc (numChunks > 0 ? numChunks : 1, sizeof (Chunk));
+
+   for (i = 0; i < numFiles; i++)
+   {
+      files[i].inode = 1 + i;
+      files[i].extent = files[i].blocks > 0 ? next : -1;
+      for (b = 0; b < files[i].blocks; b += WRITE_BATCH_BLOCKS)
+      {
+         chunks[c].file = i;
+         chunks[c].first = b;
+         chunks[c].count = files[i].blocks - b < WRITE_BATCH_BLOCKS
+            ? files[i].blocks - b : WRITE_BATCH_BLOCKS;
+         c++;
+      }
+      next += files[i].blocks;
+   }
+   return next;
+}
+
+/* reads one chunk of its file and encodes it as data blocks; returns
+ * the blocks, or NULL if the file can't be read */
+static char *
+encodeChunk (const Chunk *chunk)
+{
+   ImportFile *file = &files[chunk->file];
+   long long offset = chunk->first * EXTENT_DATA_SIZE;
+   long long length = file->size - offset;
+   char *data, *blocks;
+   data_block_t block;
+   long long done = 0, i;
+   int fd;
+
+   if (length > chunk->count * EXTENT_DATA_SIZE)
+      length = chunk->count * EXTENT_DATA_SIZE;
+   data = malloc (length);
+   blocks = malloc (chunk->count * BLOCKSIZE);
+   fd = open (file->path, O_RDONLY);
+   while (fd >= 0 && data != NULL && done < length)
+   {
+      ssize_t got = pread (fd, data + done, length - done, offset + done);
+      if (got <= 0)
+         break;
+      done += got;
+   }
+   if (fd >= 0)
+      close (fd);
+   if (done < length || blocks == NULL)
+   {
+      fprintf (stderr, "failed to read %s\n", file->path);
+      free (data);
+      free (blocks);
+      return NULL;
+   }
+
+   for (i = 0; i < chunk->count; i++)
+   {
+      long long bytes = length - i * EXTENT_DATA_SIZE;
+      if (bytes > EXTENT_DATA_SIZE)
+         bytes = EXTENT_DATA_SIZE;
+      memset (&block, 0, sizeof (block));
+      block.block_type = FILE_EXTENT_TYPE;
+      block.magic_number = MAGIC_NUMBER;
+      memcpy (block.data, data + i * EXTENT_DATA_SIZE, bytes);
+      memcpy (blocks + i * BLOCKSIZE, &block, BLOCKSIZE);
+   }
+   free (data);
+   return blocks;
+}
+
+static void *
+reader (void *arg)
+{
+   long long c;
+   char *blocks;
+
+   (void) arg;
+   for (;;)
+   {
+      pthread_mutex_lock (&lock);
+      while (nextChunk < numChunks && nextChunk >= chunksWritten + window)
+         pthread_cond_wait (&progress, &lock);
+      if (nextChunk >= numChunks)
+      {
+         pthread_mutex_unlock (&lock);
+         return NULL;
+      }
+      c = nextChunk++;
+      pthread_mutex_unlock (&lock);
+
+      blocks = encodeChunk (&chunks[c]);
+
+      pthread_mutex_lock (&lock);
+      chunks[c].blocks = blocks;
+      chunks[c].error = blocks == NULL;
+      pthread_cond_broadcast (&progress);
+      pthread_mutex_unlock (&lock);
+   }
+}
+
+/* writes the inodes, which all sit together after the superblock; each
+ * file's data is one extent */
+static int
+writeInodes (int disk)
+{
+   char *batch = malloc (WRITE_BATCH_BLOCKS * BLOCKSIZE);
+   inode_v3_t inode;
+   int first, i;
+
+   if (batch == NULL)
+      return -1;
+   for (first = 0; first < numFiles; first += WRITE_BATCH_BLOCKS)
+   {
+      int count = numFiles - first < WRITE_BATCH_BLOCKS
+         ? numFiles - first : WRITE_BATCH_BLOCKS;
+      for (i = 0; i < count; i++)
+      {
+         ImportFile *file = &files[first + i];
+         memset (&inode, 0, sizeof (inode));
+         inode.block_type = INODE_TYPE;
+         inode.magic_number = MAGIC_NUMBER;
+         strcpy (inode.file_name, file->name);
+         inode.file_size = file->size;
+         inode.extent_map = -1;
+         if (file->blocks > 0)
+         {
+            inode.extents[0].start = file->extent;
+            inode.extents[0].count = file->blocks;
+         }
+         memcpy (batch + (long long) i * BLOCKSIZE, &inode, BLOCKSIZE);
+      }
+      if (writeBlocks (disk, 1 + first, count, batch) < 0)
+      {
+         free (batch);
+         return -1;
+      }
+   }
+   free (batch);
+   return 0;
+}
+
+/* writes every chunk in disk order as the readers finish them */
+static int
+writeExtents (int disk, int threads)
+{
+   pthread_t readers[MAX_READERS];
+   int started = 0;
+   int result = 0;
+   long long c;
+   int i;
+
+   window = (long long) threads * CHUNKS_PER_READER;
+   for (i = 0; i < threads; i++)
+      if (pthread_create (&readers[started], NULL, reader, NULL) == 0)
+         started++;
+   if (started == 0)
+      return -1;
+
+   for (c = 0; c < numChunks; c++)
+   {
+      Chunk *chunk = &chunks[c];
+      pthread_mutex_lock (&lock);
+      while (chunk->blocks == NULL && !chunk->error)
+         pthread_cond_wait (&progress, &lock);
+      pthread_mutex_unlock (&lock);
+
+      if (chunk->error || result < 0
+          || writeBlocks (disk, files[chunk->file].extent + chunk->first,
+                          chunk->count, chunk->blocks) < 0)
+         result = -1;
+      free (chunk->blocks);
+      chunk->blocks = NULL;
+
+      pthread_mutex_lock (&lock);
+      chunksWritten++;
+      pthread_cond_broadcast (&progress);
+      pthread_mutex_unlock (&lock);
+   }
+
+   for (i = 0; i < started; i++)
+      pthread_join (readers[i], NULL);
+   return result;
+}
+
+int
+main (int argc, char *argv[])
+{
+   long long nBytes = 0, used, totalBlocks, bytes = 0;
+   int threads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+   superblock_t sb;
+   free_block_t last;
+   double start = now ();
+   int disk, i;
+
+   if (argc < 3)
+   {
+      fprintf (stderr, "usage: %s <diskname> <directory> [nBytes] [threads]\n",
+               argv[0]);
+      return 1;
+   }
+   if (argc > 3)
+      nBytes = atoll (argv[3]);
+   if (argc > 4)
+      threads = atoi (argv[4]);
+   if (threads < 1)
+      threads = 1;
+   if (threads > MAX_READERS)
+      threads = MAX_READERS;
+
+   if (scanDirectory (argv[2]) < 0)
+   {
+      fprintf (stderr, "failed to read %s\n", argv[2]);
+      return 1;
+   }
+   used = planLayout ();
+   for (i = 0; i < numFiles; i++)
+      bytes += files[i].size;
+   if (nBytes == 0)
+      nBytes = used * BLOCKSIZE;
+
+   disk = openDisk (argv[1], nBytes);
+   if (disk < 0)
+   {
+      fprintf (stderr, "failed to create %s\n", argv[1]);
+      return 1;
+   }
+   setStripeUnit (disk, DEFAULT_STRIPE_UNIT);
+   totalBlocks = diskBlocks (disk);
+   if (totalBlocks < used)
+   {
+      fprintf (stderr, "%s needs %lld blocks but holds %lld\n", argv[2],
+               used, totalBlocks);
+      closeDisk (disk);
+      return 1;
+   }
+
+   if (writeInodes (disk) < 0 || writeExtents (disk, threads) < 0)
+   {
+      fprintf (stderr, "failed to write %s\n", argv[1]);
+      closeDisk (disk);
+      return 1;
+   }
+
+   /* The new disk reads back as zeros, which the free list takes as
+    * links to the next block, so only the last free block needs one */
+   memset (&sb, 0, sizeof (sb));
+   sb.block_type = SUPERBLOCK_TYPE;
+   sb.magic_number = MAGIC_NUMBER;
+   sb.format_revision = FORMAT_REVISION;
+   sb.root_inode = -1;
+   sb.free_block_list = used < totalBlocks ? used : -1;
+   sb.refcount_table = -1;
+   sb.dedup_index = -1;
+   sb.stripe_unit = DEFAULT_STRIPE_UNIT;
+   memset (&last, 0, sizeof (last));
+   last.block_type = FREE_BLOCK_TYPE;
+   last.magic_number = MAGIC_NUMBER;
+   last.next_free_block = -1;
+   if ((used < totalBlocks && writeBlock (disk, totalBlocks - 1, &last) < 0)
+       || writeBlock (disk, 0, &sb) < 0 || syncDisk (disk) < 0)
+   {
+      fprintf (stderr, "failed to write %s\n", argv[1]);
+      closeDisk (disk);
+      return 1;
+   }
+   closeDisk (disk);
+
+   printf ("%d file(s), %lld bytes in %lld of %lld blocks: %.2f MB/s\n",
+           numFiles, bytes, used, totalBlocks,
+           bytes / (now () - start) / (1024.0 * 1024.0));
+   return 0;
+}
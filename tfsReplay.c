@@ -0,0 +1,227 @@
+/* TinyFS trace replay
+ * Usage: tfsReplay <tracefile> <diskname> [paced]
+ * Re-executes a trace recorded with tfs_traceStart (or TINYFS_TRACE)
+ * against a freshly made disk and reports per-operation latency. Traces
+ * that start with tfs_mkfs or tfs_mount set up the disk themselves. Without
+ * "paced" calls run back to back; with it they keep the recorded timing.
+ * Write contents are not traced, so writes replay with filler bytes of
+ * the recorded size. */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tinyFS.h"
+
+static const char *opNames[TRACE_OPS] = {
+   "?", "mkfs", "mount", "unmount", "openFile", "closeFile", "writeFile",
+   "flush", "deleteFile", "readByte", "seek", "defrag", "readAhead",
+   "cloneFile", "sparseWrites", "mapFile", "unmapFile", "readv",
+   "stripeUnit", "writeback", "sync", "fsync", "discard", "trim",
+   "dedup", "dedupStats"
+};
+
+static long long
+now (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+sleepUntil (long long when)
+{
+   long long wait = when - now ();
+   struct timespec ts;
+
+   if (wait <= 0)
+      return;
+   ts.tv_sec = wait / 1000000000LL;
+   ts.tv_nsec = wait % 1000000000LL;
+   nanosleep (&ts, NULL);
+}
+
+/* descriptors and mapping handles from the trace mapped to replayed ones */
+static fileDescriptor fdMap[MAX_OPEN_FILES];
+static int handleMap[MAX_MAPPINGS];
+
+static fileDescriptor
+mapFD (int traced)
+{
+   return traced >= 0 && traced < MAX_OPEN_FILES ? fdMap[traced] : -1;
+}
+
+static int
+replay (tfs_trace_record_t *r, char *diskname)
+{
+   static char *filler = NULL;
+   static long long fillerSize = 0;
+   tfs_iovec_t *iov, one;
+   tfs_dedup_stats_t dedupStats;
+   char c;
+   int result, count;
+
+   switch (r->op)
+   {
+   case TRACE_MKFS:
+      return tfs_mkfs (diskname, r->size);
+   case TRACE_MOUNT:
+      return tfs_mount (diskname);
+   case TRACE_UNMOUNT:
+      return tfs_unmount ();
+   case TRACE_OPEN:
+   case TRACE_CLONE:
+      result = r->op == TRACE_OPEN ? tfs_openFile (r->name)
+         : tfs_cloneFile (mapFD (r->fd), r->name);
+      if (r->result >= 0 && r->result < MAX_OPEN_FILES)
+         fdMap[r->result] = result;
+      return result;
+   case TRACE_CLOSE:
+      return tfs_closeFile (mapFD (r->fd));
+   case TRACE_WRITE:
+      if (r->size > fillerSize)
+      {
+         free (filler);
+         filler = malloc (r->size);
+         memset (filler, 'x', r->size);
+         fillerSize = r->size;
+      }
+      return tfs_writeFile (mapFD (r->fd), filler, r->size);
+   case TRACE_FLUSH:
+      return tfs_flush (mapFD (r->fd));
+   case TRACE_DELETE:
+      return tfs_deleteFile (mapFD (r->fd));
+   case TRACE_READBYTE:
+      return tfs_readByte (mapFD (r->fd), &c);
+   case TRACE_SEEK:
+      return tfs_seek (mapFD (r->fd), r->offset);
+   case TRACE_DEFRAG:
+      return tfs_defrag (r->size);
+   case TRACE_READAHEAD:
+      return tfs_readAhead (r->size);
+   case TRACE_SPARSE:
+      return tfs_sparseWrites (r->size);
+   case TRACE_STRIPE:
+      return tfs_stripeUnit (r->size);
+   case TRACE_WRITEBACK:
+      return tfs_writeback (r->size, r->offset);
+   case TRACE_SYNC:
+      return tfs_sync ();
+   case TRACE_FSYNC:
+      return tfs_fsync (mapFD (r->fd));
+   case TRACE_DISCARD:
+      return tfs_discard (r->size);
+   case TRACE_TRIM:
+      return tfs_trim ();
+   case TRACE_DEDUP:
+      return tfs_dedup (r->size);
+   case TRACE_DEDUP_STATS:
+      return tfs_dedupStats (&dedupStats);
+   case TRACE_MAP:
+      result = tfs_mapFile (mapFD (r->fd), &iov, &count);
+      if (r->result >= 0 && r->result < MAX_MAPPINGS)
+         handleMap[r->result] = result;
+      return result;
+   case TRACE_UNMAP:
+      return tfs_unmapFile (r->offset >= 0 && r->offset < MAX_MAPPINGS
+                            ? handleMap[r->offset] : -1);
+   case TRACE_READV:
+      one.base = malloc (r->size > 0 ? r->size : 1);
+      one.len = r->size;
+      result = tfs_readv (mapFD (r->fd), &one, 1);
+      free (one.base);
+      return result;
+   }
+   return -1;
+}
+
+int
+main (int argc, char *argv[])
+{
+   FILE *traceFile;
+   tfs_trace_header_t header;
+   tfs_trace_record_t r;
+   long long calls[TRACE_OPS] = {0}, total[TRACE_OPS] = {0}, worst[TRACE_OPS] = {0};
+   long long traced[TRACE_OPS] = {0}, mismatches = 0;
+   long long start, t, replayStart;
+   int paced, setup, i;
+
+   if (argc < 3)
+   {
+      fprintf (stderr, "usage: %s <tracefile> <diskname> [paced]\n", argv[0]);
+      return 1;
+   }
+   paced = argc > 3 && strcmp (argv[3], "paced") == 0;
+
+   traceFile = fopen (argv[1], "rb");
+   if (traceFile == NULL || fread (&header, sizeof (header), 1, traceFile) != 1
+       || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+   {
+      fprintf (stderr, "%s is not a TinyFS trace\n", argv[1]);
+      return 1;
+   }
+
+   for (i = 0; i < MAX_OPEN_FILES; i++)
+      fdMap[i] = -1;
+   for (i = 0; i < MAX_MAPPINGS; i++)
+      handleMap[i] = -1;
+
+   /* traces of an already mounted disk start without mkfs and mount, so
+    * the replay makes and mounts one of the size in the header; a trace
+    * that starts with a mount gets a fresh disk of the size the mount
+    * recorded, and only if that mount worked when traced */
+   setup = 0;
+   if (fread (&r, sizeof (r), 1, traceFile) == 1)
+   {
+      if (r.op == TRACE_MOUNT && r.result < 0)
+         remove (argv[2]);
+      else if (r.op == TRACE_MOUNT)
+         setup = tfs_mkfs (argv[2], r.size > 0 ? r.size : DEFAULT_DISK_SIZE);
+      else if (r.op != TRACE_MKFS)
+      {
+         setup = tfs_mkfs (argv[2], header.disk_size > 0
+                           ? header.disk_size : DEFAULT_DISK_SIZE);
+         if (setup >= 0)
+            setup = tfs_mount (argv[2]);
+      }
+   }
+   if (setup < 0 || fseek (traceFile, sizeof (header), SEEK_SET) != 0)
+   {
+      fprintf (stderr, "failed to make disk %s\n", argv[2]);
+      return 1;
+   }
+
+   replayStart = now ();
+   while (fread (&r, sizeof (r), 1, traceFile) == 1)
+   {
+      if (r.op == 0 || r.op >= TRACE_OPS)
+         continue;
+      if (paced)
+         sleepUntil (replayStart + r.start_ns);
+
+      start = now ();
+      if ((replay (&r, argv[2]) < 0) != (r.result < 0))
+         mismatches++;
+      t = now () - start;
+
+      calls[r.op]++;
+      total[r.op] += t;
+      traced[r.op] += r.duration_ns;
+      if (t > worst[r.op])
+         worst[r.op] = t;
+   }
+   fclose (traceFile);
+   tfs_unmount ();
+
+   printf ("%-13s %10s %12s %12s %12s\n", "operation", "calls",
+           "mean us", "max us", "traced us");
+   for (i = 1; i < TRACE_OPS; i++)
+      if (calls[i] > 0)
+         printf ("%-13s %10lld %12.2f %12.2f %12.2f\n", opNames[i], calls[i],
+                 total[i] / 1000.0 / calls[i], worst[i] / 1000.0,
+                 traced[i] / 1000.0 / calls[i]);
+   printf ("calls whose success differed from the trace: %lld\n", mismatches);
+   return 0;
+}
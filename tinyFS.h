@@ -5,53 +5,315 @@
 #ifndef INC_453PROJECT4_TINYFS_H
 #define INC_453PROJECT4_TINYFS_H
 
+#include <stddef.h>
+
 #define MAX_OPEN_FILES 128
 #define DEFAULT_DISK_SIZE 10240
 #define DEFAULT_DISK_NAME "tinyFSDisk"
 typedef int fileDescriptor;
+typedef long long blockNumber; // disk block address
+typedef long long byteCount;   // file size, offset or length in bytes
 
 #define BLOCKSIZE 256
 #define MAGIC_NUMBER 0x44
 
+// On-disk format revisions. Revision 1 images, from before block numbers
+// and file sizes were 64-bit, have 0 where the superblock now keeps the
+// revision; tfs_mount still reads and writes them in their own layout.
+// Revision 2 data blocks each link to the next block of their file;
+// revision 3 moves those links out into an extent map in the inode, so a
+// data block holds nothing but data and can be shared on its own.
+#define FORMAT_REVISION_32 1
+#define FORMAT_REVISION_LINKED 2
+#define FORMAT_REVISION 3
+
+// Block types stored in the first byte of every block
+#define SUPERBLOCK_TYPE 1
+#define INODE_TYPE 2
+#define FILE_EXTENT_TYPE 3
+#define FREE_BLOCK_TYPE 4
+#define REFCOUNT_TYPE 5
+#define DEDUP_TYPE 6
+#define EXTENT_MAP_TYPE 7
+
+// Block cache and sequential read-ahead window sizes, in blocks
+#define CACHE_BLOCKS 64
+#define READ_AHEAD_MIN 2
+#define READ_AHEAD_MAX 16
+
+// Most bytes tfs_writeFile buffers across all open files before flushing
+#define DELAYED_WRITE_LIMIT (1 << 20)
+
+// Defaults for tfs_writeback: how long a block may stay dirty, and the
+// percentage of the cache that may be dirty before all of it is written
+#define WRITEBACK_AGE_MS 500
+#define WRITEBACK_DIRTY_RATIO 50
+
+// Longest run of blocks write-back holds in the cache; longer runs, like
+// the free list links of a large deleted file, are written straight away
+#define WRITEBACK_RUN_BLOCKS (CACHE_BLOCKS / 4)
+
+// Most blocks a file flush writes, or a free list read fetches, in one
+// disk request
+#define WRITE_BATCH_BLOCKS 1024
+
+// Default number of block reads/writes one tfs_defrag() pass may issue
+#define DEFRAG_IO_BUDGET 64
+
+// tfs_discard modes: when freed blocks are handed back to the host
+#define DISCARD_OFF 0     // never; the image keeps its full size
+#define DISCARD_INLINE 1  // as soon as a run of blocks is freed
+#define DISCARD_BATCHED 2 // queued, then discarded by the flusher or tfs_sync
+#define DISCARD_QUEUE_RUNS 64 // freed runs queued before a batch goes out
+#define DISCARD_ALIGN_BLOCKS 16 // blocks per 4 KB host page
+
 typedef struct superblock {
    unsigned char block_type;
    unsigned char magic_number;
-   int root_inode;
-   int free_block_list;
-   char padding[BLOCKSIZE - 2 - sizeof(int)*2];
+   unsigned char format_revision;
+   blockNumber root_inode;
+   blockNumber free_block_list;
+   blockNumber refcount_table; // first block of the reference count table, or -1
+   int stripe_unit;            // blocks per stripe unit on a striped volume
+   blockNumber dedup_index;    // first block of the dedup hash index, or -1
+   char padding[BLOCKSIZE - 3 - sizeof(blockNumber)*4 - sizeof(int)];
 } superblock_t;
 
+// Revision 1 and 2 inodes keep a bitmap of holes, so files there may only
+// have holes in their first MAX_SPARSE_BLOCKS blocks (about 430 KB):
+// tfs_seek further past the end fails with E_FILE_TOO_BIG, and zero blocks
+// past it are written out. Revision 3 maps holes anywhere in a file.
+#define HOLE_MAP_BYTES 224
+#define MAX_SPARSE_BLOCKS (HOLE_MAP_BYTES * 8)
+
 typedef struct inode {
    unsigned char block_type;
    unsigned char magic_number;
    char file_name[9]; // 8 characters + NULL terminator
-   int file_size;
-   int file_extent;
-   char padding[BLOCKSIZE - 2 - 9 - sizeof(int)*2];
+   byteCount file_size;
+   blockNumber file_extent;
+   unsigned char hole_map[HOLE_MAP_BYTES]; // bit set = block is a hole
+   char padding[BLOCKSIZE - 2 - 9 - sizeof(blockNumber)*2 - HOLE_MAP_BYTES];
 } inode_t;
 
 typedef struct file_extent {
    unsigned char block_type;
    unsigned char magic_number;
-   int next_block; // block# of next file extent or inode
-   char data[BLOCKSIZE - sizeof(int) - 2]; // rest space for data
+   blockNumber next_block; // block# of next file extent or inode
+   char data[BLOCKSIZE - sizeof(blockNumber) - 2]; // rest space for data
 } file_extent_t;
 
+#define EXTENT_DATA_SIZE_V2 ((int)(BLOCKSIZE - offsetof(file_extent_t, data)))
+
+// Revision 3 inodes keep the same name and size but describe the file
+// with a map of extents in file order: runs of consecutive disk blocks, or
+// of holes, which take none. The first INODE_EXTENTS sit where revision 2
+// keeps its hole map, the rest in a chain of extent map blocks.
+typedef struct map_extent {
+   blockNumber start; // first disk block of the run, -1 for a hole
+   blockNumber count; // blocks in the run, 0 past the last extent
+} map_extent_t;
+
+#define INODE_EXTENTS (HOLE_MAP_BYTES / (int)sizeof(map_extent_t))
+
+typedef struct inode_v3 {
+   unsigned char block_type;
+   unsigned char magic_number;
+   char file_name[9];
+   byteCount file_size;
+   blockNumber extent_map; // first extent map block, -1 if the inode holds every extent
+   map_extent_t extents[INODE_EXTENTS];
+} inode_v3_t;
+
+#define MAP_BLOCK_EXTENTS ((BLOCKSIZE - 8 - (int)sizeof(blockNumber)) / (int)sizeof(map_extent_t))
+
+typedef struct extent_map_block {
+   unsigned char block_type;
+   unsigned char magic_number;
+   char reserved[6];
+   blockNumber next_block; // next block of the map, or -1
+   map_extent_t extents[MAP_BLOCK_EXTENTS];
+} extent_map_block_t;
+
+typedef struct data_block {
+   unsigned char block_type; // FILE_EXTENT_TYPE
+   unsigned char magic_number;
+   char data[BLOCKSIZE - 2];
+} data_block_t;
+
+// Bytes of file data actually stored in each extent block
+#define EXTENT_DATA_SIZE ((int)(BLOCKSIZE - offsetof(data_block_t, data)))
+
 typedef struct free_block {
    unsigned char block_type;
    unsigned char magic_number;
-   int next_free_block; // block# of next free block
-   char reserved[BLOCKSIZE - sizeof(int) - 2]; // rest space as reserved
+   blockNumber next_free_block; // block# of next free block
+   char reserved[BLOCKSIZE - sizeof(blockNumber) - 2]; // rest space as reserved
 } free_block_t;
 
-int tfs_mkfs(char *filename, int nBytes);
+// On revision 2 disks a block that reads back as all zeros was discarded
+// while free; it stands for a free block linked to the block after it
+
+// Format revision 1 layouts, with 32-bit block numbers and file sizes
+typedef struct superblock_v1 {
+   unsigned char block_type;
+   unsigned char magic_number;
+   int root_inode;
+   int free_block_list;
+   int refcount_table;
+   int stripe_unit;
+   char padding[BLOCKSIZE - 2 - sizeof(int)*4];
+} superblock_v1_t;
+
+typedef struct inode_v1 {
+   unsigned char block_type;
+   unsigned char magic_number;
+   char file_name[9];
+   int file_size;
+   int file_extent;
+   unsigned char hole_map[HOLE_MAP_BYTES];
+   char padding[BLOCKSIZE - 2 - 9 - sizeof(int)*2 - HOLE_MAP_BYTES];
+} inode_v1_t;
+
+typedef struct file_extent_v1 {
+   unsigned char block_type;
+   unsigned char magic_number;
+   int next_block;
+   char data[BLOCKSIZE - sizeof(int) - 2];
+} file_extent_v1_t;
+
+#define EXTENT_DATA_SIZE_V1 ((int)(BLOCKSIZE - offsetof(file_extent_v1_t, data)))
+
+typedef struct free_block_v1 {
+   unsigned char block_type;
+   unsigned char magic_number;
+   int next_free_block;
+   char reserved[BLOCKSIZE - sizeof(int) - 2];
+} free_block_v1_t;
+
+// Data blocks shared by cloned files carry a count of the extra files
+// using them; blocks with a count of 0 belong to a single file
+#define REFCOUNTS_PER_BLOCK (BLOCKSIZE - 2)
+#define MAX_BLOCK_REFS 255
+
+typedef struct refcount_block {
+   unsigned char block_type;
+   unsigned char magic_number;
+   unsigned char counts[REFCOUNTS_PER_BLOCK]; // indexed by block# % REFCOUNTS_PER_BLOCK
+} refcount_block_t;
+
+// tfs_dedup keeps a hash of every data block it writes in a
+// direct-mapped index, one block of it per DEDUP_INDEX_RATIO blocks of
+// disk. A slot is only a hint; the block it names is compared before it is
+// shared. Only revision 3 disks can share single blocks, so dedup leaves
+// older revisions alone.
+#define DEDUP_INDEX_RATIO 16
+
+typedef struct dedup_entry {
+   unsigned long long hash;
+   blockNumber block; // data block with that hash, 0 if the slot is empty
+} dedup_entry_t;
+
+#define DEDUP_ENTRIES_PER_BLOCK ((BLOCKSIZE - 8) / (int)sizeof(dedup_entry_t))
+
+typedef struct dedup_block {
+   unsigned char block_type;
+   unsigned char magic_number;
+   char reserved[6];
+   dedup_entry_t entries[DEDUP_ENTRIES_PER_BLOCK];
+   char padding[BLOCKSIZE - 8 - DEDUP_ENTRIES_PER_BLOCK * sizeof(dedup_entry_t)];
+} dedup_block_t;
+
+// Counters for tfs_dedupStats since the disk was mounted
+typedef struct tfs_dedup_stats {
+   long long files;         // file flushes checked for duplicates
+   long long files_shared;  // ... that shared blocks already on disk
+   long long blocks;        // data blocks those flushes needed
+   long long blocks_shared; // ... that were shared instead of written
+} tfs_dedup_stats_t;
+
+// One piece of a scatter/gather request or of a mapped file
+typedef struct tfs_iovec {
+   char *base;
+   int len;
+} tfs_iovec_t;
+
+#define MAX_MAPPINGS 32
+
+// Binary trace of tfs_* calls: a header followed by one record per call
+#define TRACE_MAGIC 0x54465354
+#define TRACE_VERSION 3
+
+#define TRACE_MKFS 1
+#define TRACE_MOUNT 2
+#define TRACE_UNMOUNT 3
+#define TRACE_OPEN 4
+#define TRACE_CLOSE 5
+#define TRACE_WRITE 6
+#define TRACE_FLUSH 7
+#define TRACE_DELETE 8
+#define TRACE_READBYTE 9
+#define TRACE_SEEK 10
+#define TRACE_DEFRAG 11
+#define TRACE_READAHEAD 12
+#define TRACE_CLONE 13
+#define TRACE_SPARSE 14
+#define TRACE_MAP 15
+#define TRACE_UNMAP 16
+#define TRACE_READV 17
+#define TRACE_STRIPE 18
+#define TRACE_WRITEBACK 19
+#define TRACE_SYNC 20
+#define TRACE_FSYNC 21
+#define TRACE_DISCARD 22
+#define TRACE_TRIM 23
+#define TRACE_DEDUP 24
+#define TRACE_DEDUP_STATS 25
+#define TRACE_OPS 26
+
+typedef struct tfs_trace_header {
+   int magic;
+   int version;
+   long long disk_size;   // bytes of the disk mounted when tracing started, 0 if none
+} tfs_trace_header_t;
+
+typedef struct tfs_trace_record {
+   long long start_ns;    // since tracing started
+   long long duration_ns;
+   long long size;        // byte count, disk size or numeric setting
+   long long offset;      // seek offset, iovec count or mapping handle
+   int fd;                // descriptor argument, -1 if none
+   int result;            // return value
+   unsigned char op;      // TRACE_* operation
+   char name[15];         // file or disk name argument, truncated
+} tfs_trace_record_t;
+
+int tfs_mkfs(char *filename, byteCount nBytes);
 int tfs_mount(char *diskname);
 int tfs_unmount(void);
 fileDescriptor tfs_openFile(char *name);
 int tfs_closeFile(fileDescriptor FD);
-int tfs_writeFile(fileDescriptor FD,char *buffer, int size);
+int tfs_writeFile(fileDescriptor FD,char *buffer, byteCount size);
 int tfs_deleteFile(fileDescriptor FD);
 int tfs_readByte(fileDescriptor FD, char *buffer);
-int tfs_seek(fileDescriptor FD, int offset);
+int tfs_seek(fileDescriptor FD, byteCount offset);
+int tfs_flush(fileDescriptor FD);
+fileDescriptor tfs_cloneFile(fileDescriptor srcFD, char *newName);
+int tfs_sparseWrites(int enabled);
+int tfs_stripeUnit(int blocks);
+int tfs_writeback(int ageMs, int dirtyRatio);
+int tfs_sync(void);
+int tfs_fsync(fileDescriptor FD);
+int tfs_discard(int mode);
+int tfs_trim(void);
+int tfs_dedup(int enabled);
+int tfs_dedupStats(tfs_dedup_stats_t *stats);
+int tfs_mapFile(fileDescriptor FD, tfs_iovec_t **iov, int *count);
+int tfs_unmapFile(int handle);
+int tfs_readv(fileDescriptor FD, tfs_iovec_t *iov, int iovcnt);
+int tfs_traceStart(char *filename);
+int tfs_traceStop(void);
+int tfs_defrag(int ioBudget);
+int tfs_readAhead(int maxBlocks);
 
 #endif //INC_453PROJECT4_TINYFS_H